@@ -0,0 +1,672 @@
+#define mr_assert(x)
+#define DISALLOW_COPY_AND_ASSIGN(c_class)                    \
+    c_class(const c_class &source) = delete;                                         \
+    c_class &operator=(const c_class &source) = delete;
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <new>
+#include <vector>
+
+#include "promise.h"
+#include "maybe.h"
+#include "monad_impl.h"
+#include "observable.h"
+#include "observable_collection.h"
+#include "memoize.h"
+#include "observable_graph.h"
+#include "snapshot.h"
+#include "result.h"
+#include "stream.h"
+
+// allocation tracking
+// every operator new in the process is counted, with the live byte count and its peak
+namespace bench_alloc
+{
+    size_t count = 0;
+    size_t current = 0;
+    size_t peak = 0;
+
+    // keeps the returned pointer aligned for any fundamental type
+    const size_t header = 16;
+}
+
+void *operator new(size_t size)
+{
+    char *p = (char *) malloc(size + bench_alloc::header);
+    if (p == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    *(size_t *) p = size;
+    bench_alloc::count++;
+    bench_alloc::current += size;
+    if (bench_alloc::current > bench_alloc::peak)
+    {
+        bench_alloc::peak = bench_alloc::current;
+    }
+    return p + bench_alloc::header;
+}
+
+void operator delete(void *ptr) noexcept
+{
+    if (ptr == nullptr)
+    {
+        return;
+    }
+    char *p = (char *) ptr - bench_alloc::header;
+    bench_alloc::current -= *(size_t *) p;
+    free(p);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+    operator delete(ptr);
+}
+
+// keep results alive so the optimizer cannot drop the measured work
+template <typename T>
+void do_not_optimize(const T &value)
+{
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+struct bench_stats
+{
+    double ns_per_op;
+    double allocs_per_op;
+    size_t peak_bytes; // above what was live before the run
+};
+
+template <typename Func>
+bench_stats measure(size_t iterations, Func f)
+{
+    size_t count_before = bench_alloc::count;
+    size_t current_before = bench_alloc::current;
+    bench_alloc::peak = bench_alloc::current;
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; i++)
+    {
+        f();
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    bench_stats ret;
+    ret.ns_per_op = std::chrono::duration<double, std::nano>(end - start).count() / iterations;
+    ret.allocs_per_op = double(bench_alloc::count - count_before) / iterations;
+    ret.peak_bytes = bench_alloc::peak - current_before;
+    return ret;
+}
+
+// enough iterations for roughly the same total work per benchmark
+size_t iterations_for(size_t work)
+{
+    return 2000000 / work + 1;
+}
+
+void report(const char *name, size_t n, const bench_stats &stats)
+{
+    printf("%-44s n=%-7zu %12.1f ns/op %10.2f allocs/op %10zu peak bytes\n",
+        name, n, stats.ns_per_op, stats.allocs_per_op, stats.peak_bytes);
+}
+
+template <typename Func>
+void bench(const char *name, size_t n, size_t work, Func f)
+{
+    report(name, n, measure(iterations_for(work), f));
+}
+
+const size_t depths[] = { 1, 8, 64 };
+const size_t sizes[] = { 1, 16, 256 };
+
+enum class errcode : int { none, invalid, overflow };
+
+// maybe
+void bench_maybe()
+{
+    for (size_t depth : depths)
+    {
+        bench("maybe fmap chain", depth, depth, [&]() {
+            maybe<int> m(1);
+            for (size_t i = 0; i < depth; i++)
+            {
+                m = std::move(m) > [](int x) { return x + 1; };
+            }
+            do_not_optimize(m);
+        });
+        bench("maybe bind chain", depth, depth, [&]() {
+            maybe<int> m(1);
+            for (size_t i = 0; i < depth; i++)
+            {
+                m = std::move(m) >= [](int x) { return maybe<int>(x + 1); };
+            }
+            do_not_optimize(m);
+        });
+    }
+    bench("maybe join", 1, 1, [&]() {
+        auto m = monad<maybe<int>>::join(maybe<maybe<int>>(maybe<int>(1)));
+        do_not_optimize(m);
+    });
+    for (size_t size : sizes)
+    {
+        std::vector<maybe<int>> ms(size, maybe<int>(1));
+        bench("maybe sequence", size, size * size, [&]() {
+            auto m = monad_sequence(ms);
+            do_not_optimize(m);
+        });
+    }
+    maybe<int> a(1), b(2), c(3);
+    bench("maybe apply (a, b, c)", 3, 1, [&]() {
+        auto m = std::make_tuple(a, b, c) > [](int a, int b, int c) { return a + b + c; };
+        do_not_optimize(m);
+    });
+}
+
+// std::vector
+// element by element push_back, the way vector fmap used to work
+template <typename T, typename Func>
+auto push_back_fmap(const std::vector<T> &from, Func f)
+{
+    std::vector<decltype(f(std::declval<T>()))> ret;
+    ret.reserve(from.size());
+    for (auto &elem : from)
+    {
+        ret.push_back(f(elem));
+    }
+    return ret;
+}
+
+template <typename T>
+void bench_vector_fmap(const char *type_name, size_t size)
+{
+    std::vector<T> v(size);
+    for (size_t i = 0; i < size; i++)
+    {
+        v[i] = T(i % 100);
+    }
+    auto f = [](T x) { return x * T(3) + T(1); };
+    char name[64];
+
+    snprintf(name, sizeof(name), "vector<%s> fmap push_back", type_name);
+    bench(name, size, size / 16 + 1, [&]() {
+        auto r = push_back_fmap(v, f);
+        do_not_optimize(r);
+    });
+
+    snprintf(name, sizeof(name), "vector<%s> fmap", type_name);
+    bench(name, size, size / 16 + 1, [&]() {
+        auto r = v > f;
+        do_not_optimize(r);
+    });
+}
+
+void bench_vector()
+{
+    for (size_t size : { 16, 1024, 65536 })
+    {
+        bench_vector_fmap<float>("float", size);
+        bench_vector_fmap<double>("double", size);
+        bench_vector_fmap<int>("int", size);
+    }
+    for (size_t size : sizes)
+    {
+        std::vector<int> v(size, 1);
+        bench("vector bind (x -> [x, x + 1])", size, size, [&]() {
+            auto r = v >= [](int x) { return std::vector<int> { x, x + 1 }; };
+            do_not_optimize(r);
+        });
+        std::vector<std::vector<int>> vv(size, std::vector<int>(4, 1));
+        bench("vector join (rows of 4)", size, size, [&]() {
+            auto r = monad<std::vector<int>>::join(vv);
+            do_not_optimize(r);
+        });
+    }
+    for (size_t size : { 2, 4, 8 })
+    {
+        std::vector<std::vector<int>> vv(size, std::vector<int> { 1, 2 });
+        bench("vector sequence (rows of 2)", size, size << size, [&]() {
+            auto r = monad_sequence(vv);
+            do_not_optimize(r);
+        });
+    }
+    for (size_t size : { 4, 32, 256 })
+    {
+        std::vector<float> a(size, 1.0f);
+        std::vector<float> b(size, 2.0f);
+        bench("vector<float> apply (a, b)", size * size, size * size / 16 + 1, [&]() {
+            auto r = std::make_tuple(a, b) > [](float x, float y) { return x * y + 1.0f; };
+            do_not_optimize(r);
+        });
+    }
+}
+
+// promise_ptr
+// chains are built on an unresolved promise and then resolved,
+// so each op covers building the graph and propagating through it
+void bench_promise()
+{
+    for (size_t depth : depths)
+    {
+        bench("promise fmap chain", depth, depth * 16, [&]() {
+            auto root = promise<int>::create();
+            promise_ptr<int> p = root;
+            for (size_t i = 0; i < depth; i++)
+            {
+                p = p > [](int x) { return x + 1; };
+            }
+            root->resolve(1);
+            do_not_optimize(p->result());
+        });
+        bench("promise bind chain", depth, depth * 32, [&]() {
+            auto root = promise<int>::create();
+            promise_ptr<int> p = root;
+            for (size_t i = 0; i < depth; i++)
+            {
+                p = p >= [](int x) { return promise<int>::create(x + 1); };
+            }
+            root->resolve(1);
+            do_not_optimize(p->result());
+        });
+    }
+    bench("promise join", 1, 16, [&]() {
+        auto p = monad<promise_ptr<int>>::join(promise<promise_ptr<int>>::create(promise<int>::create(1)));
+        do_not_optimize(p->result());
+    });
+    for (size_t size : sizes)
+    {
+        std::vector<promise_ptr<int>> ps;
+        for (size_t i = 0; i < size; i++)
+        {
+            ps.push_back(promise<int>::create(1));
+        }
+        bench("promise sequence", size, size * size * 16, [&]() {
+            auto p = monad_sequence(ps);
+            do_not_optimize(p->result());
+        });
+    }
+    bench("promise apply (a, b, c, d)", 4, 64, [&]() {
+        auto a = promise<int>::create();
+        auto b = promise<int>::create();
+        auto c = promise<int>::create();
+        auto d = promise<int>::create();
+        auto p = std::make_tuple(a, b, c, d) > [](int a, int b, int c, int d) { return a + b + c + d; };
+        a->resolve(1);
+        b->resolve(2);
+        c->resolve(3);
+        d->resolve(4);
+        do_not_optimize(p->result());
+    });
+    for (size_t size : sizes)
+    {
+        // size chains of 4 stages completing together, one by one or as a batch
+        auto make_chains = [size](std::vector<promise_ptr<int>> &roots, std::vector<promise_ptr<int>> &lasts) {
+            for (size_t i = 0; i < size; i++)
+            {
+                auto root = promise<int>::create();
+                roots.push_back(root);
+                lasts.push_back(root > [](int x) { return x + 1; } > [](int x) { return x + 1; } > [](int x) { return x + 1; });
+            }
+        };
+        bench("promise resolve each (chains of 4)", size, size * 64, [&]() {
+            std::vector<promise_ptr<int>> roots, lasts;
+            make_chains(roots, lasts);
+            for (auto &root : roots)
+            {
+                root->resolve(1);
+            }
+            do_not_optimize(lasts.back()->result());
+        });
+        bench("promise batch resolve (chains of 4)", size, size * 64, [&]() {
+            std::vector<promise_ptr<int>> roots, lasts;
+            make_chains(roots, lasts);
+            promise_batch batch;
+            batch.reserve(size);
+            for (auto &root : roots)
+            {
+                batch.add(root, 1);
+            }
+            batch.resolve();
+            do_not_optimize(lasts.back()->result());
+        });
+    }
+}
+
+// promise_ptr<result>
+void bench_promise_result()
+{
+    using R = result<int, errcode>;
+    for (size_t depth : depths)
+    {
+        bench("promise<result> fmap chain", depth, depth * 16, [&]() {
+            auto root = promise<R>::create();
+            promise_ptr<R> p = root;
+            for (size_t i = 0; i < depth; i++)
+            {
+                p = p > [](int x) { return x + 1; };
+            }
+            root->resolve(R(Ok, 1));
+            do_not_optimize(p->result());
+        });
+        bench("promise<result> bind chain", depth, depth * 32, [&]() {
+            auto root = promise<R>::create();
+            promise_ptr<R> p = root;
+            for (size_t i = 0; i < depth; i++)
+            {
+                p = p >= [](int x) { return promise<R>::create(R(Ok, x + 1)); };
+            }
+            root->resolve(R(Ok, 1));
+            do_not_optimize(p->result());
+        });
+    }
+    for (size_t size : sizes)
+    {
+        std::vector<promise_ptr<R>> ps;
+        for (size_t i = 0; i < size; i++)
+        {
+            ps.push_back(promise<R>::create(R(Ok, 1)));
+        }
+        bench("promise<result> sequence", size, size * size * 16, [&]() {
+            auto p = monad_sequence(ps);
+            do_not_optimize(p->result());
+        });
+    }
+    bench("promise<result> apply, error first", 4, 64, [&]() {
+        auto a = promise<R>::create();
+        auto b = promise<R>::create();
+        auto c = promise<R>::create();
+        auto d = promise<R>::create();
+        auto p = std::make_tuple(a, b, c, d) > [](int a, int b, int c, int d) { return a + b + c + d; };
+        a->resolve(R(Error, errcode::invalid));
+        b->resolve(R(Ok, 2));
+        c->resolve(R(Ok, 3));
+        d->resolve(R(Ok, 4));
+        do_not_optimize(p->is_finished());
+    });
+}
+
+// observable_ptr
+// graphs are built once, each op is one push at the source
+void bench_observable()
+{
+    for (size_t depth : depths)
+    {
+        bench("observable fmap chain build", depth, depth * 16, [&]() {
+            auto root = observable<int>::create(0);
+            observable_ptr<int> o = root;
+            for (size_t i = 0; i < depth; i++)
+            {
+                o = o > [](int x) { return x + 1; };
+            }
+            do_not_optimize(o->get());
+        });
+
+        auto root = observable<int>::create(0);
+        observable_ptr<int> o = root;
+        for (size_t i = 0; i < depth; i++)
+        {
+            o = o > [](int x) { return x + 1; };
+        }
+        int value = 0;
+        bench("observable fmap chain push", depth, depth * 4, [&]() {
+            root->push(value++);
+            do_not_optimize(o->get());
+        });
+    }
+    {
+        auto root = observable<int>::create(0);
+        auto o = root >= [](int x) { return observable<int>::create(x + 1); };
+        int value = 0;
+        bench("observable bind push", 1, 16, [&]() {
+            root->push(value++);
+            do_not_optimize(o->get());
+        });
+    }
+    {
+        auto inner1 = observable<int>::create(1);
+        auto inner2 = observable<int>::create(2);
+        auto outer = observable<observable_ptr<int>>::create(inner1);
+        auto o = monad<observable_ptr<int>>::join(outer);
+        bool flip = false;
+        bench("observable join switch inner", 1, 16, [&]() {
+            outer->push((flip = !flip) ? inner2 : inner1);
+            do_not_optimize(o->get());
+        });
+    }
+    for (size_t size : sizes)
+    {
+        std::vector<observable_ptr<int>> os;
+        for (size_t i = 0; i < size; i++)
+        {
+            os.push_back(observable<int>::create(1));
+        }
+        auto o = monad_sequence(os);
+        int value = 0;
+        bench("observable sequence push first", size, size * 16, [&]() {
+            os[0]->push(value++);
+            do_not_optimize(o->get());
+        });
+    }
+    {
+        auto a = observable<int>::create(1);
+        auto b = observable<int>::create(2);
+        auto c = observable<int>::create(3);
+        auto o = std::make_tuple(a, b, c) > [](int a, int b, int c) { return a + b + c; };
+        int value = 0;
+        bench("observable apply push first", 3, 16, [&]() {
+            a->push(value++);
+            do_not_optimize(o->get());
+        });
+    }
+    {
+        auto items = observable<std::vector<int>>::create(std::vector<int>(1024, 1));
+        auto o = fmap_elements(items, [](int x) { return x + 1; });
+        int value = 0;
+        bench("observable vector push one changed", 1024, 1024, [&]() {
+            auto next = items->get();
+            next[value % 1024] = value;
+            value++;
+            items->push(std::move(next));
+            do_not_optimize(o->get());
+        });
+        bench("observable vector modify one changed", 1024, 16, [&]() {
+            items->modify([&](std::vector<int> &v) {
+                size_t index = value % 1024;
+                v[index] = value++;
+                return vector_delta { { index } };
+            });
+            do_not_optimize(o->get());
+        });
+    }
+    {
+        auto items = observable<std::vector<int>>::create(std::vector<int>(1024, 1));
+        auto o = (items > [](const std::vector<int> &v) {
+            std::vector<int> out;
+            for (int x : v)
+            {
+                if (x % 2 == 0)
+                {
+                    out.push_back(x + 1);
+                }
+            }
+            return out;
+        });
+        int value = 0;
+        bench("observable vector filter+map one changed", 1024, 1024, [&]() {
+            auto next = items->get();
+            next[value % 1024] = value;
+            value++;
+            items->push(std::move(next));
+            do_not_optimize(o->get());
+        });
+
+        auto collection = observable_collection<int, int>::create();
+        for (int i = 0; i < 1024; i++)
+        {
+            collection->set(i, 1);
+        }
+        auto mapped = collection_fmap(collection_filter(collection, [](int x) { return x % 2 == 0; }), [](int x) { return x + 1; });
+        bench("collection filter+map one changed", 1024, 16, [&]() {
+            collection->set(value % 1024, value);
+            value++;
+            do_not_optimize(mapped->size());
+        });
+    }
+    {
+        // recurring inputs into a costly stage
+        auto expensive = [](int x) {
+            unsigned h = unsigned(x);
+            for (int i = 0; i < 1000; i++)
+            {
+                h = h * 2654435761u + 1;
+            }
+            return h;
+        };
+        auto root = observable<int>::create(0);
+        auto plain = root > expensive;
+        int value = 0;
+        bench("observable fmap costly, 8 recurring inputs", 1, 1000, [&]() {
+            root->push(value++ % 8);
+            do_not_optimize(plain->get());
+        });
+        auto cached = root > memoize<int>(expensive, 16);
+        plain.reset();
+        bench("observable fmap memoized, 8 recurring inputs", 1, 16, [&]() {
+            root->push(value++ % 8);
+            do_not_optimize(cached->get());
+        });
+    }
+}
+
+// stream
+void bench_stream()
+{
+    const size_t items = 4096;
+    const size_t chunk_sizes[] = { 1, 64, 1024 };
+    for (size_t chunk_size : chunk_sizes)
+    {
+        bench("stream fmap chain of 4, 4096 items", chunk_size, items * 4, [&]() {
+            std::vector<int> numbers(items, 1);
+            auto s = stream<int>::from_vector(std::move(numbers), chunk_size);
+            for (int i = 0; i < 4; i++)
+            {
+                s = s > [](int x) { return x + 1; };
+            }
+            size_t count = 0;
+            stream_for_each_chunk(s, [&](const std::vector<int> &chunk) { count += chunk.size(); });
+            do_not_optimize(count);
+        });
+    }
+}
+
+// observable graph against observable<T> nodes
+void bench_graph()
+{
+    const size_t n = 10000;
+    bench_stats plain = measure(20, [&]() {
+        auto root = observable<double>::create(0);
+        std::vector<observable_ptr<double>> cells;
+        cells.reserve(n);
+        observable_ptr<double> last = root;
+        for (size_t i = 0; i < n; i++)
+        {
+            last = last > [](double x) { return x + 1; };
+            cells.push_back(last);
+        }
+        root->push(1);
+        do_not_optimize(last->get());
+    });
+    report("observable fmap chain build+push", n, plain);
+
+    bench_stats slim = measure(20, [&]() {
+        observable_graph<double> graph;
+        graph.reserve(n + 1, n);
+        auto root = graph.add(0);
+        auto f = graph.add_formula([](const double *in, size_t) { return in[0] + 1; });
+        auto last = root;
+        for (size_t i = 0; i < n; i++)
+        {
+            last = graph.add(f, { last });
+        }
+        graph.push(root, 1);
+        do_not_optimize(graph.get(last));
+    });
+    report("observable_graph chain build+push", n, slim);
+    printf("bytes per node: observable %.1f, observable_graph %.1f (node %zu + edge %zu)\n",
+        double(plain.peak_bytes) / n, double(slim.peak_bytes) / n,
+        observable_graph<double>::node_bytes, observable_graph<double>::edge_bytes);
+}
+
+// snapshot of 1000 observables, 256 ints each
+void bench_snapshot()
+{
+    const size_t n = 1000;
+    std::vector<observable_ptr<std::vector<int>>> os;
+    observable_snapshot snapshot;
+    for (size_t i = 0; i < n; i++)
+    {
+        os.push_back(observable<std::vector<int>>::create(std::vector<int>(256, int(i))));
+        snapshot.add("cell" + std::to_string(i), os.back());
+    }
+    std::string blob;
+    bench("snapshot save", n, n * 64, [&]() {
+        blob = snapshot.save();
+    });
+    bench("snapshot restore", n, n * 64, [&]() {
+        auto restored = snapshot.restore(blob.data(), blob.size());
+        do_not_optimize(restored.ok());
+    });
+}
+
+// result
+// out of line so the result has to cross a real call boundary;
+// a trivially copyable result<int, errcode> comes back in a register
+__attribute__((noinline)) result<int, errcode> checked_add(int a, int b)
+{
+    int sum;
+    if (__builtin_add_overflow(a, b, &sum))
+    {
+        return result<int, errcode>(Error, errcode::overflow);
+    }
+    return result<int, errcode>(Ok, sum);
+}
+
+void bench_result()
+{
+    using R = result<int, errcode>;
+    printf("sizeof(result<int, errcode>) = %zu, trivially copyable = %d\n", sizeof(R), (int) std::is_trivially_copyable<R>::value);
+
+    int acc = 0;
+    bench("result<int, errcode> return", 1, 1, [&]() {
+        auto r = checked_add(acc, 1);
+        acc = r.is_ok() ? r.ok() & 0xffff : 0;
+    });
+    do_not_optimize(acc);
+
+    for (size_t depth : depths)
+    {
+        bench("result bind chain", depth, depth, [&]() {
+            R r(Ok, acc);
+            for (size_t i = 0; i < depth; i++)
+            {
+                r = r >= [](int x) { return checked_add(x, 1); };
+            }
+            do_not_optimize(r);
+        });
+    }
+}
+
+int main()
+{
+    bench_maybe();
+    bench_vector();
+    bench_promise();
+    bench_promise_result();
+    bench_observable();
+    bench_stream();
+    bench_graph();
+    bench_snapshot();
+    bench_result();
+    return 0;
+}
@@ -0,0 +1,752 @@
+#pragma once
+
+// bounded lock-free channels for handing values between threads
+// producers call try_send / send from their own threads: one producer for
+// channel_producers::single (an spsc ring), any number for multiple (an mpsc ring).
+// receiving, and everything built on a channel (fmap, join, the adapters), happens
+// on one consumer thread, usually an event loop's.
+// a full channel is backpressure: try_send fails and leaves the value with the caller.
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "maybe.h"
+#include "event_loop.h"
+
+// one cache line between indices written by different threads
+struct channel_padding
+{
+    char bytes[64];
+};
+
+inline size_t channel_ring_capacity(size_t capacity)
+{
+    size_t ret = 1;
+    while (ret < capacity)
+    {
+        ret <<= 1;
+    }
+    return ret;
+}
+
+// single producer, single consumer
+template <typename T>
+class spsc_ring
+{
+    using storage = typename std::aligned_storage<sizeof(T), alignof(T)>::type;
+
+    const size_t mask;
+    std::unique_ptr<storage[]> slots;
+    channel_padding pad0;
+    std::atomic<size_t> head { 0 }; // written by the consumer
+    size_t cached_tail = 0;
+    channel_padding pad1;
+    std::atomic<size_t> tail { 0 }; // written by the producer
+    size_t cached_head = 0;
+    channel_padding pad2;
+
+    T *slot(size_t index) { return reinterpret_cast<T *>(&slots[index & mask]); }
+
+public:
+    explicit spsc_ring(size_t capacity) : mask(channel_ring_capacity(capacity) - 1), slots(new storage[mask + 1]) {}
+
+    ~spsc_ring()
+    {
+        while (try_pop([](T &&) {}))
+        {
+        }
+    }
+
+    size_t capacity() const { return mask + 1; }
+
+    template <typename P>
+    bool try_push(P &&value)
+    {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - cached_head > mask)
+        {
+            cached_head = head.load(std::memory_order_acquire);
+            if (t - cached_head > mask)
+            {
+                return false;
+            }
+        }
+        new (slot(t)) T(std::forward<P>(value));
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    // calls f with the value moved out of the ring
+    template <typename Func>
+    bool try_pop(Func &&f)
+    {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == cached_tail)
+        {
+            cached_tail = tail.load(std::memory_order_acquire);
+            if (h == cached_tail)
+            {
+                return false;
+            }
+        }
+        T *value = slot(h);
+        f(std::move(*value));
+        value->~T();
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    // exact on the consumer thread when it is also the only producer
+    bool full() const
+    {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire) > mask;
+    }
+
+    bool empty() const
+    {
+        return tail.load(std::memory_order_acquire) == head.load(std::memory_order_acquire);
+    }
+
+    DISALLOW_COPY_AND_ASSIGN(spsc_ring);
+};
+
+// multiple producers, single consumer; bounded queue with a sequence number per cell
+template <typename T>
+class mpsc_ring
+{
+    struct cell
+    {
+        std::atomic<size_t> sequence;
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type value;
+
+        T *get() { return reinterpret_cast<T *>(&value); }
+    };
+
+    const size_t mask;
+    std::unique_ptr<cell[]> cells;
+    channel_padding pad0;
+    std::atomic<size_t> tail { 0 }; // claimed by producers
+    channel_padding pad1;
+    size_t head = 0; // consumer only
+    channel_padding pad2;
+
+public:
+    explicit mpsc_ring(size_t capacity) : mask(channel_ring_capacity(capacity) - 1), cells(new cell[mask + 1])
+    {
+        for (size_t i = 0; i <= mask; i++)
+        {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    ~mpsc_ring()
+    {
+        while (try_pop([](T &&) {}))
+        {
+        }
+    }
+
+    size_t capacity() const { return mask + 1; }
+
+    template <typename P>
+    bool try_push(P &&value)
+    {
+        size_t pos = tail.load(std::memory_order_relaxed);
+        cell *c;
+        while (true)
+        {
+            c = &cells[pos & mask];
+            size_t sequence = c->sequence.load(std::memory_order_acquire);
+            intptr_t diff = intptr_t(sequence) - intptr_t(pos);
+            if (diff == 0)
+            {
+                if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if (diff < 0)
+            {
+                return false; // full
+            }
+            else
+            {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+        new (c->get()) T(std::forward<P>(value));
+        c->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    template <typename Func>
+    bool try_pop(Func &&f)
+    {
+        cell &c = cells[head & mask];
+        if (c.sequence.load(std::memory_order_acquire) != head + 1)
+        {
+            return false;
+        }
+        f(std::move(*c.get()));
+        c.get()->~T();
+        c.sequence.store(head + mask + 1, std::memory_order_release);
+        head++;
+        return true;
+    }
+
+    bool full() const
+    {
+        size_t pos = tail.load(std::memory_order_acquire);
+        return intptr_t(cells[pos & mask].sequence.load(std::memory_order_acquire)) - intptr_t(pos) < 0;
+    }
+
+    bool empty() const
+    {
+        return cells[head & mask].sequence.load(std::memory_order_acquire) != head + 1;
+    }
+
+    DISALLOW_COPY_AND_ASSIGN(mpsc_ring);
+};
+
+enum class channel_producers { single, multiple };
+
+// a consumer's wakeup: producer threads fire it after a send, at most once until
+// the consumer rearms it. a channel fires every notifier added to it, and a derived
+// channel adds its consumer's notifier to the channels it receives from, since
+// those are the ones producers send to.
+class channel_notifier
+{
+    std::function<void()> f;
+    std::atomic<bool> pending { false };
+
+public:
+    channel_notifier(std::function<void()> f) : f(std::move(f)) {}
+
+    void fire()
+    {
+        if (!pending.load(std::memory_order_acquire) && !pending.exchange(true, std::memory_order_acq_rel))
+        {
+            f();
+        }
+    }
+
+    // even if already fired, for a close
+    void fire_always()
+    {
+        pending.store(true, std::memory_order_release);
+        f();
+    }
+
+    void rearm()
+    {
+        pending.store(false, std::memory_order_release);
+    }
+};
+using channel_notifier_ptr = std::shared_ptr<channel_notifier>;
+
+// consumer side: a notifier can be added any number of times, each add needs a remove
+class channel_waitable
+{
+public:
+    virtual ~channel_waitable() = default;
+    virtual void add_notifier(const channel_notifier_ptr &n) = 0;
+    virtual void remove_notifier(const channel_notifier *n) = 0;
+};
+
+template <typename T, channel_producers Producers = channel_producers::single>
+class channel : public channel_waitable
+{
+    using ring_type = typename std::conditional<Producers == channel_producers::single, spsc_ring<T>, mpsc_ring<T>>::type;
+
+    ring_type ring;
+    std::atomic<bool> closed { false };
+
+    // what producers fire, published copy on write by the consumer so producers read
+    // it without a lock. a list is never freed before the channel, since a producer
+    // may still be reading one that was replaced.
+    using notifier_list = std::vector<channel_notifier_ptr>;
+    std::atomic<const notifier_list *> notifiers { nullptr };
+    std::vector<std::unique_ptr<const notifier_list>> published_notifiers;
+    channel_notifier_ptr own_notifier; // from set_notify
+
+    // consumer side: refills the ring from upstream (fmap, join), false once upstream is done
+    std::function<bool(channel &)> pump;
+    std::vector<std::shared_ptr<void>> upstream;
+    std::vector<channel_waitable *> notify_upstream; // kept alive by upstream, or by the pump
+
+    channel(size_t capacity) : ring(capacity) {}
+
+    DISALLOW_COPY_AND_ASSIGN(channel);
+
+    void sent()
+    {
+        const notifier_list *list = notifiers.load(std::memory_order_acquire);
+        if (list != nullptr)
+        {
+            for (auto &n : *list)
+            {
+                n->fire();
+            }
+        }
+    }
+
+    const notifier_list &current_notifiers() const
+    {
+        static const notifier_list none;
+        const notifier_list *list = notifiers.load(std::memory_order_relaxed);
+        return list != nullptr ? *list : none;
+    }
+
+    void publish_notifiers(notifier_list list)
+    {
+        published_notifiers.emplace_back(new notifier_list(std::move(list)));
+        notifiers.store(published_notifiers.back().get(), std::memory_order_release);
+    }
+
+    void detach_upstream_notifiers()
+    {
+        for (auto *source : notify_upstream)
+        {
+            for (auto &n : current_notifiers())
+            {
+                source->remove_notifier(n.get());
+            }
+        }
+        notify_upstream.clear();
+    }
+
+    // false once the pump is done, and the channel closed
+    bool refill()
+    {
+        if (pump == nullptr)
+        {
+            return false;
+        }
+        if (!pump(*this))
+        {
+            detach_upstream_notifiers();
+            pump = nullptr;
+            upstream.clear();
+            close();
+            return false;
+        }
+        return true;
+    }
+
+public:
+    using ResultType = T;
+
+    static std::shared_ptr<channel> create(size_t capacity)
+    {
+        return std::shared_ptr<channel>(new channel(capacity));
+    }
+
+    size_t capacity() const { return ring.capacity(); }
+
+    // producer side
+
+    // false if the channel is full or closed, the value is then left untouched
+    bool try_send(T &&value)
+    {
+        if (closed.load(std::memory_order_acquire) || !ring.try_push(std::move(value)))
+        {
+            return false;
+        }
+        sent();
+        return true;
+    }
+
+    bool try_send(const T &value)
+    {
+        if (closed.load(std::memory_order_acquire) || !ring.try_push(value))
+        {
+            return false;
+        }
+        sent();
+        return true;
+    }
+
+    // waits for room, false if the channel is closed
+    bool send(T value)
+    {
+        while (!try_send(std::move(value)))
+        {
+            if (closed.load(std::memory_order_acquire))
+            {
+                return false;
+            }
+            std::this_thread::yield();
+        }
+        return true;
+    }
+
+    // values already sent can still be received
+    void close()
+    {
+        closed.store(true, std::memory_order_release);
+        const notifier_list *list = notifiers.load(std::memory_order_acquire);
+        if (list != nullptr)
+        {
+            for (auto &n : *list)
+            {
+                n->fire_always();
+            }
+        }
+    }
+
+    bool is_closed() const { return closed.load(std::memory_order_acquire); }
+
+    // consumer side
+
+    // calls f with the next value, if there is one
+    template <typename Func>
+    bool try_receive_with(Func &&f)
+    {
+        if (ring.try_pop(f))
+        {
+            return true;
+        }
+        if (pump != nullptr)
+        {
+            refill();
+            return ring.try_pop(f);
+        }
+        return false;
+    }
+
+    maybe<T> try_receive()
+    {
+        maybe<T> ret;
+        try_receive_with([&ret](T &&value) { ret.initialize(std::move(value)); });
+        return ret;
+    }
+
+    // calls f with every value available now, returns how many
+    template <typename Func>
+    size_t receive_all(Func f)
+    {
+        size_t count = 0;
+        while (try_receive_with(f))
+        {
+            count++;
+        }
+        return count;
+    }
+
+    // closed and nothing left to receive; runs the pump of a derived channel
+    bool is_finished()
+    {
+        if (!ring.empty())
+        {
+            return false;
+        }
+        if (refill())
+        {
+            return false;
+        }
+        return is_closed() && ring.empty();
+    }
+
+    // on the consumer thread, before it waits for values; f is called from producer threads.
+    // a second call replaces the first notifier, which may still run once.
+    void set_notify(std::function<void()> f)
+    {
+        if (own_notifier != nullptr)
+        {
+            remove_notifier(own_notifier.get());
+        }
+        own_notifier = std::make_shared<channel_notifier>(std::move(f));
+        add_notifier(own_notifier);
+    }
+
+    // the consumer is about to drain, notify again on the next send
+    void rearm_notify()
+    {
+        if (own_notifier != nullptr)
+        {
+            own_notifier->rearm();
+        }
+    }
+
+    void add_notifier(const channel_notifier_ptr &n) override
+    {
+        notifier_list list = current_notifiers();
+        list.push_back(n);
+        publish_notifiers(std::move(list));
+        for (auto *source : notify_upstream)
+        {
+            source->add_notifier(n);
+        }
+    }
+
+    void remove_notifier(const channel_notifier *n) override
+    {
+        notifier_list list = current_notifiers();
+        auto it = std::find_if(list.begin(), list.end(), [n](const channel_notifier_ptr &other) { return other.get() == n; });
+        if (it == list.end())
+        {
+            return;
+        }
+        list.erase(it);
+        publish_notifiers(std::move(list));
+        for (auto *source : notify_upstream)
+        {
+            source->remove_notifier(n);
+        }
+    }
+
+    // consumer side plumbing for derived channels
+    template <typename Func>
+    void set_pump(Func f)
+    {
+        pump = std::move(f);
+    }
+
+    bool full() const { return ring.full(); }
+
+    // a value produced on the consumer thread by a pump
+    template <typename P>
+    bool push_from_pump(P &&value)
+    {
+        return ring.try_push(std::forward<P>(value));
+    }
+
+    void hold(std::shared_ptr<void> object)
+    {
+        upstream.push_back(std::move(object));
+    }
+
+    // a channel the pump receives from, which must stay alive until removed
+    void add_notify_upstream(channel_waitable *source)
+    {
+        notify_upstream.push_back(source);
+        for (auto &n : current_notifiers())
+        {
+            source->add_notifier(n);
+        }
+    }
+
+    void remove_notify_upstream(channel_waitable *source)
+    {
+        auto it = std::find(notify_upstream.begin(), notify_upstream.end(), source);
+        if (it == notify_upstream.end())
+        {
+            return;
+        }
+        notify_upstream.erase(it);
+        for (auto &n : current_notifiers())
+        {
+            source->remove_notifier(n.get());
+        }
+    }
+};
+
+template <typename T, channel_producers Producers = channel_producers::single>
+using channel_ptr = std::shared_ptr<channel<T, Producers>>;
+template <typename T, channel_producers Producers = channel_producers::single>
+using channel_weak_ptr = std::weak_ptr<channel<T, Producers>>;
+
+// adapters, on the thread running `loop`
+
+// calls on_value(value) for each value received, as long as it returns true,
+// and on_finished() once the channel is closed and drained
+template <typename T, channel_producers P, typename Func, typename Finished>
+void watch_channel(event_loop &loop, channel_ptr<T, P> ch, Func on_value, Finished on_finished)
+{
+    struct waker
+    {
+        int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        ~waker() { close(fd); }
+    };
+    auto w = std::make_shared<waker>();
+    mr_assert(w->fd >= 0);
+    int fd = w->fd;
+    ch->set_notify([w]() {
+        uint64_t one = 1;
+        ssize_t unused = write(w->fd, &one, sizeof(one));
+        (void) unused;
+    });
+
+    auto drain = [&loop, ch, w, on_value, on_finished](uint32_t) mutable {
+        uint64_t value;
+        ssize_t unused = read(w->fd, &value, sizeof(value));
+        (void) unused;
+        ch->rearm_notify();
+        bool keep = true;
+        while (keep && ch->try_receive_with([&](T &&v) { keep = on_value(std::move(v)); }))
+        {
+        }
+        if (!keep || ch->is_finished())
+        {
+            int fd = w->fd;
+            loop.unwatch(fd); // event_loop keeps this callback alive until it returns
+            on_finished();
+        }
+    };
+    loop.watch(fd, EPOLLIN, drain);
+    // values sent before the notify was set
+    uint64_t one = 1;
+    ssize_t unused = write(fd, &one, sizeof(one));
+    (void) unused;
+}
+
+// an observable pushed every value received; it starts with `initial`
+template <typename T, channel_producers P>
+observable_ptr<T> to_observable(event_loop &loop, channel_ptr<T, P> ch, T initial)
+{
+    auto ret_observable = observable<T>::create(std::move(initial));
+    observable_weak_ptr<T> weak_ret_observable(ret_observable);
+    watch_channel(loop, std::move(ch), [weak_ret_observable](T &&value) {
+        auto o = weak_ret_observable.lock();
+        if (o)
+        {
+            o->push(std::move(value));
+        }
+        return o != nullptr;
+    }, []() {});
+    return ret_observable;
+}
+
+// resolves with the next value received; never resolves if the channel finishes first
+template <typename T, channel_producers P>
+promise_ptr<T> next_value(event_loop &loop, channel_ptr<T, P> ch)
+{
+    auto ret_promise = promise<T>::create();
+    promise_weak_ptr<T> weak_ret_promise(ret_promise);
+    watch_channel(loop, std::move(ch), [weak_ret_promise](T &&value) {
+        auto p = weak_ret_promise.lock();
+        if (p)
+        {
+            p->resolve(std::move(value));
+        }
+        return false;
+    }, []() {});
+    return ret_promise;
+}
+
+// every value pushed to `o`, dropping values (counted in `dropped`) while the channel is full
+template <typename T>
+channel_ptr<T> from_observable(observable_ptr<T> o, size_t capacity, std::shared_ptr<std::atomic<size_t>> dropped = nullptr)
+{
+    auto ret = channel<T>::create(capacity);
+    channel<T> *ch = ret.get();
+    auto handle = o->observe([ch, dropped](const T &value) {
+        if (!ch->try_send(value) && dropped)
+        {
+            dropped->fetch_add(1, std::memory_order_relaxed);
+        }
+    });
+    ret->hold(std::shared_ptr<void>(handle.to_ptr()));
+    return ret;
+}
+
+// the promised value, then closed
+template <typename T>
+channel_ptr<T> from_promise(promise_ptr<T> p)
+{
+    auto ret = channel<T>::create(1);
+    channel_weak_ptr<T> weak_ret(ret);
+    p->then([weak_ret](const T &value) {
+        auto ch = weak_ret.lock();
+        if (ch)
+        {
+            ch->try_send(value);
+            ch->close();
+        }
+    });
+    ret->hold(std::move(p));
+    return ret;
+}
+
+
+// monad implementation
+#include "monad.h"
+
+// derived channels are filled on the consumer thread as it receives:
+// fmap moves values from upstream through f while there is room, so backpressure
+// reaches the source; join receives from each inner channel until it is finished.
+template <typename T, channel_producers Producers>
+struct monad<channel_ptr<T, Producers>>
+{
+    using ElemType = T;
+    template <typename U> using OtherType = channel_ptr<U>;
+    using M = channel_ptr<T, Producers>;
+    static const bool has_monad = true;
+
+    template <typename Func>
+    static auto fmap(M from, Func f)
+    {
+        using To = decltype(f(std::declval<T>()));
+        auto ret = channel<To>::create(from->capacity());
+        channel<T, Producers> *source = from.get();
+        ret->set_pump([source, f = std::move(f)](channel<To> &self) mutable {
+            while (!self.full() && source->try_receive_with([&self, &f](T &&value) { self.push_from_pump(f(std::move(value))); }))
+            {
+            }
+            return !source->is_finished();
+        });
+        ret->add_notify_upstream(source);
+        ret->hold(std::move(from));
+        return ret;
+    }
+
+    template <channel_producers Inner, channel_producers Outer>
+    static channel_ptr<T> join(channel_ptr<channel_ptr<T, Inner>, Outer> from)
+    {
+        auto ret = channel<T>::create(from->capacity());
+        auto source = from.get();
+        ret->set_pump([source, current = channel_ptr<T, Inner>()](channel<T> &self) mutable {
+            while (!self.full())
+            {
+                if (current == nullptr)
+                {
+                    source->try_receive_with([&current](channel_ptr<T, Inner> &&inner) { current = std::move(inner); });
+                    if (current == nullptr)
+                    {
+                        break;
+                    }
+                    self.add_notify_upstream(current.get());
+                }
+                bool got = current->try_receive_with([&self](T &&value) { self.push_from_pump(std::move(value)); });
+                if (!got)
+                {
+                    if (!current->is_finished())
+                    {
+                        break; // wait for more from the current inner channel
+                    }
+                    self.remove_notify_upstream(current.get());
+                    current = nullptr;
+                }
+            }
+            return current != nullptr || !source->is_finished();
+        });
+        ret->add_notify_upstream(source);
+        ret->hold(std::move(from));
+        return ret;
+    }
+
+    static channel_ptr<T> wrap(T obj)
+    {
+        auto ret = channel<T>::create(1);
+        ret->try_send(std::move(obj));
+        ret->close();
+        return ret;
+    }
+
+    template <typename Func>
+    static auto bind(M p, Func f)
+    {
+        using RetType = decltype(f(std::declval<T>()));
+        return monad<RetType>::join(fmap(std::move(p), std::move(f)));
+    }
+};
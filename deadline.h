@@ -0,0 +1,247 @@
+#pragma once
+
+// time for promise_ptr<result<T, E>>: timeouts, deadlines and retries
+// timers come from a monad_clock, either an event loop or a virtual clock that
+// tests advance by hand. a clock must outlive the promises using it.
+// a promise shed by a timeout or deadline releases its upstream right away.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+
+#include "event_loop.h"
+#include "promise.h"
+#include "result.h"
+
+class monad_clock
+{
+public:
+    virtual ~monad_clock() = default;
+    virtual uint64_t now() const = 0; // milliseconds
+    // calls f once after `delay`, returns an id for cancel()
+    virtual uint64_t schedule(std::chrono::milliseconds delay, std::function<void()> f) = 0;
+    virtual void cancel(uint64_t id) = 0;
+};
+
+class event_loop_clock : public monad_clock
+{
+    event_loop &loop;
+public:
+    event_loop_clock(event_loop &loop) : loop(loop) {}
+
+    uint64_t now() const override { return loop.now(); }
+    uint64_t schedule(std::chrono::milliseconds delay, std::function<void()> f) override { return loop.add_timer(delay, std::move(f)); }
+    void cancel(uint64_t id) override { loop.cancel_timer(id); }
+};
+
+// time only moves when advance() is called
+class virtual_clock : public monad_clock
+{
+    uint64_t _now = 0;
+    uint64_t next_id = 1;
+    std::map<std::pair<uint64_t, uint64_t>, std::function<void()>> timers; // keyed by (deadline, id)
+    std::unordered_map<uint64_t, uint64_t> deadlines; // id -> deadline, to find a timer by id
+public:
+    uint64_t now() const override { return _now; }
+
+    uint64_t schedule(std::chrono::milliseconds delay, std::function<void()> f) override
+    {
+        uint64_t id = next_id++;
+        uint64_t deadline = _now + delay.count();
+        timers.emplace(std::make_pair(deadline, id), std::move(f));
+        deadlines.emplace(id, deadline);
+        return id;
+    }
+
+    void cancel(uint64_t id) override
+    {
+        auto it = deadlines.find(id);
+        if (it != deadlines.end())
+        {
+            timers.erase(std::make_pair(it->second, id));
+            deadlines.erase(it);
+        }
+    }
+
+    // fires due timers in order, including ones scheduled while advancing
+    void advance(std::chrono::milliseconds duration)
+    {
+        uint64_t target = _now + duration.count();
+        while (!timers.empty() && timers.begin()->first.first <= target)
+        {
+            auto it = timers.begin();
+            _now = std::max(_now, it->first.first);
+            auto f = std::move(it->second);
+            deadlines.erase(it->first.second);
+            timers.erase(it);
+            f();
+        }
+        _now = target;
+    }
+
+    size_t pending() const { return timers.size(); }
+};
+
+// an absolute point in a clock's time, passed down so nested calls share one budget
+class monad_deadline
+{
+    uint64_t at;
+    explicit monad_deadline(uint64_t at) : at(at) {}
+public:
+    static monad_deadline never() { return monad_deadline(UINT64_MAX); }
+    static monad_deadline after(const monad_clock &clock, std::chrono::milliseconds duration)
+    {
+        return monad_deadline(clock.now() + duration.count());
+    }
+
+    bool is_never() const { return at == UINT64_MAX; }
+    uint64_t time() const { return at; }
+    bool expired(const monad_clock &clock) const { return clock.now() >= at; }
+
+    std::chrono::milliseconds remaining(const monad_clock &clock) const
+    {
+        uint64_t now = clock.now();
+        return std::chrono::milliseconds(at > now ? at - now : 0);
+    }
+
+    // the earlier of the two
+    monad_deadline min(const monad_deadline &other) const
+    {
+        return monad_deadline(std::min(at, other.at));
+    }
+};
+
+// resolves like `p`, or with `error` if `p` has not resolved within `duration`
+template <typename T, typename E>
+promise_ptr<result<T, E>> timeout(monad_clock &clock, promise_ptr<result<T, E>> p, std::chrono::milliseconds duration, E error)
+{
+    using Result = result<T, E>;
+    auto ret_promise = promise<Result>::create();
+    promise_weak_ptr<Result> weak_ret_promise(ret_promise);
+    uint64_t timer = clock.schedule(duration, [weak_ret_promise, error]() {
+        auto ret_promise = weak_ret_promise.lock();
+        if (ret_promise && !ret_promise->is_finished())
+        {
+            ret_promise->resolve(Result(Error, error));
+        }
+    });
+    p->then([weak_ret_promise, &clock, timer](const Result &data) {
+        clock.cancel(timer);
+        auto ret_promise = weak_ret_promise.lock();
+        if (ret_promise && !ret_promise->is_finished())
+        {
+            ret_promise->resolve(data);
+        }
+    });
+    ret_promise->hold_promise(std::move(p));
+    return ret_promise;
+}
+
+template <typename T, typename E>
+promise_ptr<result<T, E>> with_deadline(monad_clock &clock, const monad_deadline &deadline, promise_ptr<result<T, E>> p, E error)
+{
+    if (deadline.is_never())
+    {
+        return p;
+    }
+    return timeout(clock, std::move(p), deadline.remaining(clock), std::move(error));
+}
+
+template <typename E>
+struct retry_policy
+{
+    E timeout_error; // reported for attempts cut off by attempt_timeout or the deadline
+    size_t max_attempts = 3;
+    std::chrono::milliseconds initial_backoff = std::chrono::milliseconds(10);
+    double multiplier = 2.0;
+    std::chrono::milliseconds max_backoff = std::chrono::milliseconds(1000);
+    std::chrono::milliseconds attempt_timeout = std::chrono::milliseconds(0); // 0 for none
+    monad_deadline deadline = monad_deadline::never(); // for all attempts together
+    std::function<bool(const E &)> retryable; // empty retries every error
+
+    retry_policy(E timeout_error) : timeout_error(std::move(timeout_error)) {}
+};
+
+// calls factory(deadline) until it resolves ok, with exponential backoff between attempts;
+// the deadline handed to the factory is the attempt's, for it to propagate downstream.
+// gives up with the last error after max_attempts, a non retryable error, or when the
+// next attempt would start past the deadline.
+template <typename E, typename Factory>
+auto retry(monad_clock &clock, retry_policy<E> policy, Factory factory)
+{
+    using P = decltype(factory(std::declval<const monad_deadline &>()));
+    using Result = typename P::element_type::ResultType;
+
+    struct state : std::enable_shared_from_this<state>
+    {
+        monad_clock &clock;
+        retry_policy<E> policy;
+        Factory factory;
+        promise_weak_ptr<Result> ret_promise;
+        size_t attempts = 0;
+        std::chrono::milliseconds backoff;
+
+        state(monad_clock &clock, retry_policy<E> policy, Factory factory)
+            : clock(clock), policy(std::move(policy)), factory(std::move(factory)), backoff(this->policy.initial_backoff) {}
+
+        void attempt()
+        {
+            auto ret = ret_promise.lock();
+            if (!ret)
+            {
+                return;
+            }
+            attempts++;
+            monad_deadline deadline = policy.deadline;
+            if (policy.attempt_timeout.count() > 0)
+            {
+                deadline = deadline.min(monad_deadline::after(clock, policy.attempt_timeout));
+            }
+            auto p = with_deadline(clock, deadline, factory(deadline), policy.timeout_error);
+            auto self = this->shared_from_this();
+            const base_promise *attempt = p.get();
+            // held first, an attempt that has already resolved is released right away
+            ret->hold_promise(p);
+            p->then([self, attempt](const Result &data) { self->attempted(attempt, data); });
+        }
+
+        void attempted(const base_promise *attempt, const Result &data)
+        {
+            auto ret = ret_promise.lock();
+            if (!ret)
+            {
+                return;
+            }
+            // a resolved attempt is not needed anymore, only the next one is
+            ret->release_promise(attempt);
+            if (ret->is_finished())
+            {
+                return;
+            }
+            bool give_up = data.is_ok()
+                || attempts >= policy.max_attempts
+                || (policy.retryable && !policy.retryable(data.error()))
+                || clock.now() + backoff.count() >= policy.deadline.time();
+            if (give_up)
+            {
+                ret->resolve(data);
+                return;
+            }
+            auto self = this->shared_from_this();
+            clock.schedule(backoff, [self]() { self->attempt(); });
+            auto next = std::chrono::milliseconds(int64_t(backoff.count() * policy.multiplier));
+            backoff = std::min(next, policy.max_backoff);
+        }
+    };
+
+    auto ret_promise = promise<Result>::create();
+    auto s = std::make_shared<state>(clock, std::move(policy), std::move(factory));
+    s->ret_promise = ret_promise;
+    s->attempt();
+    return ret_promise;
+}
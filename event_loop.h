@@ -0,0 +1,452 @@
+#pragma once
+
+// single threaded event loop driving promises and observables (linux only)
+// epoll for file descriptors, an eventfd for wakeups and a hierarchical timer wheel
+// with 1ms ticks. everything except wake() must be called on the loop's thread.
+
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "promise.h"
+#include "observable.h"
+#include "scheduler.h"
+
+// hierarchical timer wheel
+// level i has 64 slots of 64^i ticks each; a timer sits in the lowest level
+// that covers its distance and cascades down as the wheel turns.
+// timers further out than the top level are parked there and re-placed on cascade.
+class timer_wheel
+{
+public:
+    using callback = std::function<void()>;
+    static const int level_bits = 6;
+    static const uint64_t slot_count = 1 << level_bits;
+    static const int level_count = 4;
+
+    struct due_timer
+    {
+        uint64_t deadline;
+        callback cb;
+    };
+
+private:
+    struct entry
+    {
+        uint64_t id;
+        uint64_t deadline;
+    };
+
+    std::vector<entry> slots[level_count][slot_count];
+    std::unordered_map<uint64_t, callback> callbacks; // cancelled timers are only removed here
+    uint64_t now_tick = 0;
+    uint64_t next_id = 1;
+
+    static uint64_t slot_index(uint64_t tick, int level)
+    {
+        return (tick >> (level_bits * level)) & (slot_count - 1);
+    }
+
+    void place(const entry &e, std::vector<due_timer> &due)
+    {
+        if (e.deadline <= now_tick)
+        {
+            collect(e, due);
+            return;
+        }
+        uint64_t distance = e.deadline - now_tick;
+        int level = 0;
+        while (level < level_count - 1 && distance >= (uint64_t(1) << (level_bits * (level + 1))))
+        {
+            level++;
+        }
+        slots[level][slot_index(e.deadline, level)].push_back(e);
+    }
+
+    void collect(const entry &e, std::vector<due_timer> &due)
+    {
+        auto it = callbacks.find(e.id);
+        if (it != callbacks.end())
+        {
+            due.push_back(due_timer { e.deadline, std::move(it->second) });
+            callbacks.erase(it);
+        }
+    }
+
+public:
+    uint64_t now() const { return now_tick; }
+    size_t size() const { return callbacks.size(); }
+
+    uint64_t add(uint64_t deadline, callback cb)
+    {
+        uint64_t id = next_id++;
+        callbacks.emplace(id, std::move(cb));
+        // due timers fire on the next tick at the earliest
+        entry e { id, deadline > now_tick ? deadline : now_tick + 1 };
+        std::vector<due_timer> unused;
+        place(e, unused);
+        return id;
+    }
+
+    void cancel(uint64_t id)
+    {
+        callbacks.erase(id);
+    }
+
+    // turn the wheel up to `tick`, appending due timers in deadline order
+    void advance(uint64_t tick, std::vector<due_timer> &due)
+    {
+        if (callbacks.empty())
+        {
+            now_tick = tick > now_tick ? tick : now_tick;
+            return;
+        }
+        while (now_tick < tick)
+        {
+            now_tick++;
+            for (int level = 1; level < level_count; level++)
+            {
+                if ((now_tick & ((uint64_t(1) << (level_bits * level)) - 1)) != 0)
+                {
+                    break;
+                }
+                auto entries = std::move(slots[level][slot_index(now_tick, level)]);
+                slots[level][slot_index(now_tick, level)].clear();
+                for (auto &e : entries)
+                {
+                    place(e, due);
+                }
+            }
+
+            auto &slot = slots[0][slot_index(now_tick, 0)];
+            for (auto &e : slot)
+            {
+                collect(e, due);
+            }
+            slot.clear();
+        }
+    }
+
+    // ticks until the wheel next needs to turn, -1 if there are no timers;
+    // may be early when a higher level has to cascade
+    int64_t ticks_until_next() const
+    {
+        if (callbacks.empty())
+        {
+            return -1;
+        }
+        for (uint64_t t = 1; t <= slot_count; t++)
+        {
+            uint64_t tick = now_tick + t;
+            if (!slots[0][slot_index(tick, 0)].empty() || slot_index(tick, 0) == 0)
+            {
+                return t;
+            }
+        }
+        return slot_count;
+    }
+};
+
+// how late timers fire, in microseconds past their deadline
+struct event_loop_lag
+{
+    uint64_t last_us = 0;
+    uint64_t max_us = 0;
+    uint64_t total_us = 0;
+    uint64_t samples = 0;
+
+    void record(uint64_t us)
+    {
+        last_us = us;
+        max_us = us > max_us ? us : max_us;
+        total_us += us;
+        samples++;
+    }
+
+    uint64_t average_us() const { return samples == 0 ? 0 : total_us / samples; }
+};
+
+class event_loop
+{
+    using clock = std::chrono::steady_clock;
+    using task = std::function<void()>;
+    using fd_callback = std::function<void(uint32_t)>;
+
+    int epoll_fd;
+    int wake_fd;
+    clock::time_point start;
+    bool stopped = false;
+
+    timer_wheel timers;
+    std::vector<task> posted;
+    // pushes are coalesced per observable, only the latest value is pushed
+    std::vector<task> pushes;
+    std::unordered_map<const base_observable *, size_t> push_index;
+    std::unordered_map<int, std::shared_ptr<fd_callback>> watchers; // shared, so a callback can unwatch itself
+
+    event_loop_lag _lag;
+
+    DISALLOW_COPY_AND_ASSIGN(event_loop);
+
+    uint64_t now_us() const
+    {
+        return std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - start).count();
+    }
+
+    // run a batch of tasks in one scheduler dispatch,
+    // so in trampoline mode their continuations run after the whole batch
+    static void run_batch(std::vector<task> &batch)
+    {
+        continuation_scheduler::get().dispatch([&batch]() {
+            for (auto &t : batch)
+            {
+                t();
+            }
+        });
+    }
+
+    void run_timers()
+    {
+        std::vector<timer_wheel::due_timer> due;
+        uint64_t now = now_us();
+        timers.advance(now / 1000, due);
+        if (due.empty())
+        {
+            return;
+        }
+        std::vector<task> batch;
+        batch.reserve(due.size());
+        for (auto &d : due)
+        {
+            _lag.record(now - d.deadline * 1000);
+            batch.push_back(std::move(d.cb));
+        }
+        run_batch(batch);
+    }
+
+    void run_posted()
+    {
+        std::vector<task> batch;
+        batch.swap(posted);
+        std::vector<task> push_batch;
+        push_batch.swap(pushes);
+        push_index.clear();
+
+        batch.insert(batch.end(), std::make_move_iterator(push_batch.begin()), std::make_move_iterator(push_batch.end()));
+        if (!batch.empty())
+        {
+            run_batch(batch);
+        }
+    }
+
+public:
+    event_loop() : epoll_fd(epoll_create1(EPOLL_CLOEXEC)), wake_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)), start(clock::now())
+    {
+        mr_assert(epoll_fd >= 0 && wake_fd >= 0);
+        epoll_event ev {};
+        ev.events = EPOLLIN;
+        ev.data.fd = wake_fd;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+    }
+
+    ~event_loop()
+    {
+        close(wake_fd);
+        close(epoll_fd);
+    }
+
+    // milliseconds since the loop was created, the timer clock
+    uint64_t now() const { return now_us() / 1000; }
+    const event_loop_lag &lag() const { return _lag; }
+
+    // run on the next iteration; all tasks posted before it are run as one batch
+    void post(task t)
+    {
+        posted.emplace_back(std::move(t));
+    }
+
+    template <typename T, typename... P>
+    void resolve_later(promise_ptr<T> p, P &&... params)
+    {
+        post([p = std::move(p), value = T(std::forward<P>(params)...)]() mutable {
+            p->resolve(std::move(value));
+        });
+    }
+
+    template <typename T>
+    void push_later(observable_ptr<T> o, T value)
+    {
+        const base_observable *key = o.get();
+        task t = [o = std::move(o), value = std::move(value)]() mutable {
+            o->push(std::move(value));
+        };
+        auto it = push_index.find(key);
+        if (it != push_index.end())
+        {
+            pushes[it->second] = std::move(t);
+        }
+        else
+        {
+            push_index.emplace(key, pushes.size());
+            pushes.push_back(std::move(t));
+        }
+    }
+
+    uint64_t add_timer(std::chrono::milliseconds delay, task cb)
+    {
+        return timers.add(now() + delay.count(), std::move(cb));
+    }
+
+    void cancel_timer(uint64_t id)
+    {
+        timers.cancel(id);
+    }
+
+    void watch(int fd, uint32_t events, fd_callback cb)
+    {
+        epoll_event ev {};
+        ev.events = events;
+        ev.data.fd = fd;
+        int op = watchers.count(fd) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+        watchers[fd] = std::make_shared<fd_callback>(std::move(cb));
+        epoll_ctl(epoll_fd, op, fd, &ev);
+    }
+
+    void unwatch(int fd)
+    {
+        if (watchers.erase(fd))
+        {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+        }
+    }
+
+    // the only call that is safe from another thread
+    void wake()
+    {
+        uint64_t one = 1;
+        ssize_t unused = write(wake_fd, &one, sizeof(one));
+        (void) unused;
+    }
+
+    void stop()
+    {
+        stopped = true;
+        wake();
+    }
+
+    bool has_work() const
+    {
+        return !posted.empty() || !pushes.empty() || timers.size() > 0 || !watchers.empty();
+    }
+
+    // one iteration: wait for io or the next timer (at most max_wait_ms, -1 for no limit),
+    // then run io callbacks, due timers and posted tasks
+    void run_once(int max_wait_ms = -1)
+    {
+        int timeout = -1;
+        if (!posted.empty() || !pushes.empty())
+        {
+            timeout = 0;
+        }
+        else
+        {
+            int64_t ticks = timers.ticks_until_next();
+            if (ticks >= 0)
+            {
+                // ticks are counted from the wheel's last turn, not from now
+                int64_t wait = int64_t(timers.now() + ticks) - int64_t(now());
+                timeout = wait > 0 ? int(wait) : 0;
+            }
+        }
+        if (max_wait_ms >= 0 && (timeout < 0 || timeout > max_wait_ms))
+        {
+            timeout = max_wait_ms;
+        }
+
+        epoll_event events[64];
+        int count = epoll_wait(epoll_fd, events, 64, timeout);
+        for (int i = 0; i < count; i++)
+        {
+            int fd = events[i].data.fd;
+            if (fd == wake_fd)
+            {
+                uint64_t value;
+                ssize_t unused = read(wake_fd, &value, sizeof(value));
+                (void) unused;
+                continue;
+            }
+            auto it = watchers.find(fd);
+            if (it != watchers.end())
+            {
+                auto cb = it->second; // the callback may unwatch itself
+                (*cb)(events[i].events);
+            }
+        }
+
+        run_timers();
+        run_posted();
+    }
+
+    // until stop() is called or there is nothing left to wait for
+    void run()
+    {
+        stopped = false;
+        while (!stopped && has_work())
+        {
+            run_once();
+        }
+    }
+};
+
+// promise sources
+
+// resolves with `value` after `duration`; the timer only holds a weak reference
+template <typename T>
+promise_ptr<T> delay(event_loop &loop, std::chrono::milliseconds duration, T value)
+{
+    auto ret_promise = promise<T>::create();
+    promise_weak_ptr<T> weak_ret_promise(ret_promise);
+    loop.add_timer(duration, [weak_ret_promise, value = std::move(value)]() mutable {
+        auto ret_promise = weak_ret_promise.lock();
+        if (ret_promise)
+        {
+            ret_promise->resolve(std::move(value));
+        }
+    });
+    return ret_promise;
+}
+
+// resolves with the value of `p`, or empty if `p` is not resolved within `duration`;
+// `p` is released as soon as either happens. for a timeout with an error instead,
+// see timeout() in deadline.h. `loop` must outlive `p`.
+template <typename T>
+promise_ptr<maybe<T>> timeout_or_empty(event_loop &loop, promise_ptr<T> p, std::chrono::milliseconds duration)
+{
+    auto ret_promise = promise<maybe<T>>::create();
+    promise_weak_ptr<maybe<T>> weak_ret_promise(ret_promise);
+    uint64_t timer = loop.add_timer(duration, [weak_ret_promise]() {
+        auto ret_promise = weak_ret_promise.lock();
+        if (ret_promise && !ret_promise->is_finished())
+        {
+            ret_promise->resolve(maybe<T>());
+        }
+    });
+    p->then([weak_ret_promise, &loop, timer](const T &data) {
+        loop.cancel_timer(timer);
+        auto ret_promise = weak_ret_promise.lock();
+        if (ret_promise && !ret_promise->is_finished())
+        {
+            ret_promise->resolve(data);
+        }
+    });
+    ret_promise->hold_promise(std::move(p));
+    return ret_promise;
+}
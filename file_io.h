@@ -0,0 +1,621 @@
+#pragma once
+
+// asynchronous file reads and writes as promise sources (linux only)
+// requests go to io_uring when the kernel allows it, otherwise to a small thread pool
+// doing pread / pwrite. either way completions come back through an eventfd watched by
+// the event loop, so promises are only resolved on the loop's thread.
+// reads land in buffers from a pool registered with the kernel, and that same buffer
+// is what the continuations see.
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+#include "event_loop.h"
+#include "result.h"
+
+struct io_error
+{
+    int code; // errno
+
+    std::string message() const { return strerror(code); }
+};
+
+// bytes shared between copies, either a slot of an io_buffer_pool or a heap block
+class io_buffer
+{
+    std::shared_ptr<char> storage;
+    size_t _size = 0;
+    size_t _capacity = 0;
+    int _index = -1;
+
+    friend class io_buffer_pool;
+    io_buffer(std::shared_ptr<char> storage, size_t size, size_t capacity, int index)
+        : storage(std::move(storage)), _size(size), _capacity(capacity), _index(index) {}
+public:
+    io_buffer() = default;
+    explicit io_buffer(size_t capacity)
+        : storage(new char[capacity], std::default_delete<char[]>()), _size(capacity), _capacity(capacity) {}
+
+    char *data() { return storage.get(); }
+    const char *data() const { return storage.get(); }
+    size_t size() const { return _size; }
+    size_t capacity() const { return _capacity; }
+    void resize(size_t size) { _size = size <= _capacity ? size : _capacity; }
+
+    // index of the slot registered with the kernel, -1 for heap buffers
+    int registered_index() const { return _index; }
+
+    std::string str() const { return std::string(data(), _size); }
+};
+
+// fixed size buffers carved from one allocation; a slot returns to the pool
+// when the last io_buffer referring to it is gone, even after the pool itself
+class io_buffer_pool
+{
+    struct state
+    {
+        std::unique_ptr<char[]> memory;
+        size_t buffer_size;
+        size_t count;
+        std::mutex mutex;
+        std::vector<int> free_slots;
+    };
+    std::shared_ptr<state> pool;
+
+public:
+    io_buffer_pool(size_t buffer_size, size_t count) : pool(std::make_shared<state>())
+    {
+        pool->memory.reset(new char[buffer_size * count]);
+        pool->buffer_size = buffer_size;
+        pool->count = count;
+        for (size_t i = count; i > 0; i--)
+        {
+            pool->free_slots.push_back(int(i - 1));
+        }
+    }
+
+    size_t buffer_size() const { return pool->buffer_size; }
+
+    std::vector<iovec> iovecs() const
+    {
+        std::vector<iovec> ret(pool->count);
+        for (size_t i = 0; i < pool->count; i++)
+        {
+            ret[i].iov_base = pool->memory.get() + i * pool->buffer_size;
+            ret[i].iov_len = pool->buffer_size;
+        }
+        return ret;
+    }
+
+    // falls back to a heap buffer if the pool is exhausted or `size` does not fit a slot
+    io_buffer acquire(size_t size)
+    {
+        if (size <= pool->buffer_size)
+        {
+            std::lock_guard<std::mutex> lock(pool->mutex);
+            if (!pool->free_slots.empty())
+            {
+                int index = pool->free_slots.back();
+                pool->free_slots.pop_back();
+                auto keep = pool;
+                std::shared_ptr<char> storage(pool->memory.get() + index * pool->buffer_size, [keep, index](char *) {
+                    std::lock_guard<std::mutex> lock(keep->mutex);
+                    keep->free_slots.push_back(index);
+                });
+                return io_buffer(std::move(storage), size, pool->buffer_size, index);
+            }
+        }
+        return io_buffer(size);
+    }
+};
+
+struct io_request
+{
+    enum class kind { read, write };
+
+    kind op;
+    uint64_t id;
+    int fd;
+    uint64_t offset;
+    char *data;
+    size_t length;
+    int buffer_index;
+};
+
+class io_backend
+{
+public:
+    virtual ~io_backend() = default;
+    virtual void submit(const io_request &request) = 0;
+    // calls complete(id, res) for every finished request, res is a byte count or -errno
+    virtual void reap(const std::function<void(uint64_t, int)> &complete) = 0;
+    // readable when there is something to reap
+    virtual int completion_fd() const = 0;
+};
+
+class io_uring_backend : public io_backend
+{
+    int ring_fd = -1;
+    int event_fd = -1;
+    void *sq_ring = MAP_FAILED;
+    void *cq_ring = MAP_FAILED;
+    size_t sq_ring_size = 0;
+    size_t cq_ring_size = 0;
+    io_uring_sqe *sqes = static_cast<io_uring_sqe *>(MAP_FAILED);
+    size_t sqes_size = 0;
+
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    io_uring_cqe *cqes;
+    unsigned sq_entries = 0;
+    unsigned cq_entries = 0;
+
+    bool fixed_buffers = false;
+    unsigned in_flight = 0;
+    std::deque<io_request> backlog; // waiting for a free submission slot
+    std::vector<std::pair<uint64_t, int>> failed; // refused by io_uring_enter, reported by reap
+
+    static int setup(unsigned entries, io_uring_params *params)
+    {
+        return int(syscall(__NR_io_uring_setup, entries, params));
+    }
+
+    static int enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+    {
+        return int(syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0));
+    }
+
+    static int register_with(int fd, unsigned opcode, const void *arg, unsigned count)
+    {
+        return int(syscall(__NR_io_uring_register, fd, opcode, arg, count));
+    }
+
+    template <typename T>
+    static T *at(void *base, unsigned offset)
+    {
+        return reinterpret_cast<T *>(static_cast<char *>(base) + offset);
+    }
+
+    // in flight requests are capped at the completion queue size, so it cannot overflow
+    bool push(const io_request &request)
+    {
+        unsigned tail = *sq_tail;
+        if (tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries || in_flight >= cq_entries)
+        {
+            return false;
+        }
+        unsigned index = tail & *sq_mask;
+        io_uring_sqe &sqe = sqes[index];
+        memset(&sqe, 0, sizeof(sqe));
+        bool fixed = fixed_buffers && request.buffer_index >= 0;
+        if (request.op == io_request::kind::read)
+        {
+            sqe.opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+        }
+        else
+        {
+            sqe.opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+        }
+        sqe.fd = request.fd;
+        sqe.off = request.offset;
+        sqe.addr = uint64_t(uintptr_t(request.data));
+        sqe.len = unsigned(request.length);
+        sqe.buf_index = fixed ? uint16_t(request.buffer_index) : 0;
+        sqe.user_data = request.id;
+        sq_array[index] = index;
+        __atomic_store_n(sq_tail, tail + 1, __ATOMIC_RELEASE);
+        in_flight++;
+        return true;
+    }
+
+    void flush()
+    {
+        while (!backlog.empty() && push(backlog.front()))
+        {
+            backlog.pop_front();
+        }
+        unsigned pending = *sq_tail - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        if (pending == 0)
+        {
+            return;
+        }
+        int submitted;
+        do
+        {
+            submitted = enter(ring_fd, pending, 0, 0);
+        }
+        while (submitted < 0 && errno == EINTR);
+
+        if (submitted >= 0 || errno == EAGAIN || errno == EBUSY)
+        {
+            if (submitted < 0 || unsigned(submitted) < pending)
+            {
+                // the rest stay in the ring; wake reap, which flushes again
+                wake();
+            }
+            return;
+        }
+
+        // the kernel has not taken them, so they come back off the ring and fail
+        int code = -errno;
+        unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        for (unsigned i = head; i != *sq_tail; i++)
+        {
+            failed.emplace_back(sqes[sq_array[i & *sq_mask]].user_data, code);
+            in_flight--;
+        }
+        __atomic_store_n(sq_tail, head, __ATOMIC_RELEASE);
+        wake();
+    }
+
+    void wake()
+    {
+        uint64_t one = 1;
+        ssize_t unused = write(event_fd, &one, sizeof(one));
+        (void) unused;
+    }
+
+    template <typename Func>
+    void drain(Func f)
+    {
+        unsigned head = *cq_head;
+        while (head != __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE))
+        {
+            io_uring_cqe cqe = cqes[head & *cq_mask];
+            head++;
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+            in_flight--;
+            f(cqe.user_data, cqe.res);
+        }
+    }
+
+public:
+    io_uring_backend() = default;
+
+    // false if io_uring is unavailable (old kernel, seccomp, ...)
+    bool init(unsigned entries, const io_buffer_pool &pool)
+    {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        ring_fd = setup(entries, &params);
+        if (ring_fd < 0)
+        {
+            return false;
+        }
+        sq_entries = params.sq_entries;
+        cq_entries = params.cq_entries;
+
+        sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+        if (single_mmap)
+        {
+            sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+        }
+        sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        if (sq_ring == MAP_FAILED)
+        {
+            return false;
+        }
+        cq_ring = single_mmap ? sq_ring : mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED)
+        {
+            return false;
+        }
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = static_cast<io_uring_sqe *>(mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES));
+        if (sqes == MAP_FAILED)
+        {
+            return false;
+        }
+
+        sq_head = at<unsigned>(sq_ring, params.sq_off.head);
+        sq_tail = at<unsigned>(sq_ring, params.sq_off.tail);
+        sq_mask = at<unsigned>(sq_ring, params.sq_off.ring_mask);
+        sq_array = at<unsigned>(sq_ring, params.sq_off.array);
+        cq_head = at<unsigned>(cq_ring, params.cq_off.head);
+        cq_tail = at<unsigned>(cq_ring, params.cq_off.tail);
+        cq_mask = at<unsigned>(cq_ring, params.cq_off.ring_mask);
+        cqes = at<io_uring_cqe>(cq_ring, params.cq_off.cqes);
+
+        event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (event_fd < 0 || register_with(ring_fd, IORING_REGISTER_EVENTFD, &event_fd, 1) < 0)
+        {
+            return false;
+        }
+        // may fail on a low RLIMIT_MEMLOCK, pool buffers are then used unregistered
+        auto iovecs = pool.iovecs();
+        fixed_buffers = register_with(ring_fd, IORING_REGISTER_BUFFERS, iovecs.data(), unsigned(iovecs.size())) == 0;
+        return true;
+    }
+
+    ~io_uring_backend()
+    {
+        // the kernel may still be writing into our buffers
+        while (in_flight > 0 && ring_fd >= 0)
+        {
+            if (enter(ring_fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR)
+            {
+                break;
+            }
+            drain([](uint64_t, int) {});
+        }
+        if (sqes != MAP_FAILED)
+        {
+            munmap(sqes, sqes_size);
+        }
+        if (cq_ring != MAP_FAILED && cq_ring != sq_ring)
+        {
+            munmap(cq_ring, cq_ring_size);
+        }
+        if (sq_ring != MAP_FAILED)
+        {
+            munmap(sq_ring, sq_ring_size);
+        }
+        if (event_fd >= 0)
+        {
+            close(event_fd);
+        }
+        if (ring_fd >= 0)
+        {
+            close(ring_fd);
+        }
+    }
+
+    bool has_fixed_buffers() const { return fixed_buffers; }
+
+    void submit(const io_request &request) override
+    {
+        backlog.push_back(request);
+        flush();
+    }
+
+    void reap(const std::function<void(uint64_t, int)> &complete) override
+    {
+        uint64_t value;
+        ssize_t unused = read(event_fd, &value, sizeof(value));
+        (void) unused;
+        std::vector<std::pair<uint64_t, int>> refused;
+        refused.swap(failed);
+        for (auto &it : refused)
+        {
+            complete(it.first, it.second);
+        }
+        drain(complete);
+        flush();
+    }
+
+    int completion_fd() const override { return event_fd; }
+
+    DISALLOW_COPY_AND_ASSIGN(io_uring_backend);
+};
+
+class io_thread_pool_backend : public io_backend
+{
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::deque<io_request> requests;
+    std::vector<std::pair<uint64_t, int>> completions;
+    bool stopping = false;
+    int event_fd;
+
+    void work()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true)
+        {
+            wakeup.wait(lock, [this]() { return stopping || !requests.empty(); });
+            if (stopping)
+            {
+                return;
+            }
+            io_request request = requests.front();
+            requests.pop_front();
+            lock.unlock();
+
+            ssize_t res = request.op == io_request::kind::read
+                ? pread(request.fd, request.data, request.length, off_t(request.offset))
+                : pwrite(request.fd, request.data, request.length, off_t(request.offset));
+            int code = res < 0 ? -errno : int(res);
+
+            lock.lock();
+            completions.emplace_back(request.id, code);
+            uint64_t one = 1;
+            ssize_t unused = write(event_fd, &one, sizeof(one));
+            (void) unused;
+        }
+    }
+
+public:
+    io_thread_pool_backend(size_t threads) : event_fd(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC))
+    {
+        mr_assert(event_fd >= 0);
+        for (size_t i = 0; i < threads; i++)
+        {
+            workers.emplace_back([this]() { work(); });
+        }
+    }
+
+    // queued requests are dropped, running ones finish first
+    ~io_thread_pool_backend()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        wakeup.notify_all();
+        for (auto &worker : workers)
+        {
+            worker.join();
+        }
+        close(event_fd);
+    }
+
+    void submit(const io_request &request) override
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            requests.push_back(request);
+        }
+        wakeup.notify_one();
+    }
+
+    void reap(const std::function<void(uint64_t, int)> &complete) override
+    {
+        std::vector<std::pair<uint64_t, int>> done;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            uint64_t value;
+            ssize_t unused = read(event_fd, &value, sizeof(value));
+            (void) unused;
+            done.swap(completions);
+        }
+        for (auto &it : done)
+        {
+            complete(it.first, it.second);
+        }
+    }
+
+    int completion_fd() const override { return event_fd; }
+
+    DISALLOW_COPY_AND_ASSIGN(io_thread_pool_backend);
+};
+
+// the completion fd is only watched while requests are in flight,
+// so an idle file_io does not keep event_loop::run() going
+class file_io
+{
+public:
+    using read_result = result<io_buffer, io_error>;
+    using write_result = result<size_t, io_error>;
+
+private:
+    event_loop &loop;
+    io_buffer_pool pool;
+    // declared before the backend, so buffers outlive requests still running in it
+    std::unordered_map<uint64_t, std::function<void(int)>> in_flight;
+    std::unique_ptr<io_backend> backend;
+    bool uring = false;
+    uint64_t next_id = 1;
+
+    DISALLOW_COPY_AND_ASSIGN(file_io);
+
+    void start(io_request::kind op, int fd, uint64_t offset, io_buffer &buffer, std::function<void(int)> done)
+    {
+        if (in_flight.empty())
+        {
+            loop.watch(backend->completion_fd(), EPOLLIN, [this](uint32_t) { reap(); });
+        }
+        uint64_t id = next_id++;
+        in_flight.emplace(id, std::move(done));
+        backend->submit(io_request { op, id, fd, offset, buffer.data(), buffer.size(), buffer.registered_index() });
+    }
+
+    void reap()
+    {
+        backend->reap([this](uint64_t id, int res) {
+            auto it = in_flight.find(id);
+            if (it != in_flight.end())
+            {
+                auto done = std::move(it->second);
+                in_flight.erase(it);
+                done(res);
+            }
+        });
+        if (in_flight.empty())
+        {
+            loop.unwatch(backend->completion_fd());
+        }
+    }
+
+public:
+    file_io(event_loop &loop, size_t buffer_size = 64 * 1024, size_t buffer_count = 32, bool use_io_uring = true, size_t threads = 4)
+        : loop(loop), pool(buffer_size, buffer_count)
+    {
+        if (use_io_uring)
+        {
+            std::unique_ptr<io_uring_backend> ring(new io_uring_backend());
+            if (ring->init(256, pool))
+            {
+                backend = std::move(ring);
+                uring = true;
+            }
+        }
+        if (!backend)
+        {
+            backend.reset(new io_thread_pool_backend(threads));
+        }
+    }
+
+    ~file_io()
+    {
+        loop.unwatch(backend->completion_fd());
+    }
+
+    bool uses_io_uring() const { return uring; }
+    size_t pending() const { return in_flight.size(); }
+
+    // a pool buffer to fill for write(), it is written without copying
+    io_buffer acquire_buffer(size_t size)
+    {
+        return pool.acquire(size);
+    }
+
+    // up to `length` bytes at `offset`, fewer at the end of the file
+    promise_ptr<read_result> read(int fd, uint64_t offset, size_t length)
+    {
+        auto ret_promise = promise<read_result>::create();
+        io_buffer buffer = pool.acquire(length);
+        start(io_request::kind::read, fd, offset, buffer, [ret_promise, buffer](int res) mutable {
+            if (res < 0)
+            {
+                ret_promise->resolve(read_result(Error, io_error { -res }));
+            }
+            else
+            {
+                buffer.resize(size_t(res));
+                ret_promise->resolve(read_result(Ok, std::move(buffer)));
+            }
+        });
+        return ret_promise;
+    }
+
+    // resolves with the number of bytes written
+    promise_ptr<write_result> write(int fd, uint64_t offset, io_buffer data)
+    {
+        auto ret_promise = promise<write_result>::create();
+        start(io_request::kind::write, fd, offset, data, [ret_promise, data](int res) {
+            if (res < 0)
+            {
+                ret_promise->resolve(write_result(Error, io_error { -res }));
+            }
+            else
+            {
+                ret_promise->resolve(write_result(Ok, size_t(res)));
+            }
+        });
+        return ret_promise;
+    }
+
+    promise_ptr<write_result> write(int fd, uint64_t offset, const std::string &data)
+    {
+        io_buffer buffer = pool.acquire(data.size());
+        memcpy(buffer.data(), data.data(), data.size());
+        return write(fd, offset, std::move(buffer));
+    }
+};
@@ -1,30 +1,130 @@
 #pragma once
 
+#include <algorithm>
+#include <new>
+#include <type_traits>
 #include <vector>
 
-template <typename T>
+// holds objects until cleared or destroyed
+// the first InlineCapacity objects are stored inline, only the rest go to the heap;
+// most promise / observable nodes hold one or two
+template <typename T, size_t InlineCapacity = 2>
 class generic_holder
 {
-    std::vector<T> objects;
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type inline_objects[InlineCapacity];
+    size_t inline_count = 0;
+    std::vector<T> spilled_objects;
+
+    T *inline_at(size_t index)
+    {
+        return reinterpret_cast<T *>(&inline_objects[index]);
+    }
+
+    void take(generic_holder &other)
+    {
+        for (size_t i = 0; i < other.inline_count; i++)
+        {
+            new (inline_at(i)) T(std::move(*other.inline_at(i)));
+        }
+        inline_count = other.inline_count;
+        spilled_objects = std::move(other.spilled_objects);
+        other.clear();
+    }
 public:
     generic_holder() = default;
-    generic_holder(generic_holder &&other) = default;
-    generic_holder &operator = (generic_holder &&other) = default;
+    generic_holder(generic_holder &&other)
+    {
+        take(other);
+    }
+    generic_holder &operator = (generic_holder &&other)
+    {
+        if (this != &other)
+        {
+            clear();
+            take(other);
+        }
+        return *this;
+    }
 
     void hold(T object)
     {
-        objects.emplace_back(std::move(object));
+        if (inline_count < InlineCapacity)
+        {
+            new (inline_at(inline_count)) T(std::move(object));
+            inline_count++;
+        }
+        else
+        {
+            spilled_objects.emplace_back(std::move(object));
+        }
     }
 
     void clear()
     {
-        objects.clear();
+        // destroying an object may hold or clear through this holder again,
+        // so everything is moved out to locals first
+        typename std::aligned_storage<sizeof(T), alignof(T)>::type objects[InlineCapacity];
+        size_t count = inline_count;
+        for (size_t i = 0; i < count; i++)
+        {
+            new (&objects[i]) T(std::move(*inline_at(i)));
+            inline_at(i)->~T();
+        }
+        inline_count = 0;
+        std::vector<T> spilled = std::move(spilled_objects);
+        spilled_objects.clear();
+
+        for (size_t i = 0; i < count; i++)
+        {
+            reinterpret_cast<T *>(&objects[i])->~T();
+        }
+    }
+
+    // drops the first object matching `pred`, keeping the others in order
+    template <typename Pred>
+    void release_if(Pred pred)
+    {
+        for (size_t i = 0; i < inline_count; i++)
+        {
+            if (pred(*inline_at(i)))
+            {
+                // destroyed on return, once the holder is consistent again
+                T object(std::move(*inline_at(i)));
+                for (size_t j = i + 1; j < inline_count; j++)
+                {
+                    *inline_at(j - 1) = std::move(*inline_at(j));
+                }
+                if (!spilled_objects.empty())
+                {
+                    *inline_at(inline_count - 1) = std::move(spilled_objects.front());
+                    spilled_objects.erase(spilled_objects.begin());
+                }
+                else
+                {
+                    inline_at(inline_count - 1)->~T();
+                    inline_count--;
+                }
+                return;
+            }
+        }
+
+        auto it = std::find_if(spilled_objects.begin(), spilled_objects.end(), pred);
+        if (it != spilled_objects.end())
+        {
+            T object(std::move(*it));
+            spilled_objects.erase(it);
+        }
+    }
+
+    size_t size() const
+    {
+        return inline_count + spilled_objects.size();
     }
 
     ~generic_holder()
     {
         clear();
     }
-    
+
     DISALLOW_COPY_AND_ASSIGN(generic_holder);
 };
@@ -0,0 +1,253 @@
+#pragma once
+
+// opt-in runtime instrumentation for promise and observable graphs
+// define MONAD_INSTRUMENTATION before including any header to enable it;
+// otherwise every hook compiles to nothing.
+// like the rest of the library, it is not thread safe.
+
+#ifdef MONAD_INSTRUMENTATION
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <ostream>
+#include <string>
+#include <typeindex>
+#include <typeinfo>
+#include <utility>
+#include <unordered_map>
+#include <vector>
+#ifdef __GNUG__
+#include <cxxabi.h>
+#endif
+
+// bucket i counts samples in [2^i, 2^(i+1)) nanoseconds
+struct monad_latency_histogram
+{
+    static const int bucket_count = 40;
+    uint64_t buckets[bucket_count] = {};
+
+    void record(uint64_t ns)
+    {
+        int bucket = 0;
+        while (ns > 1 && bucket < bucket_count - 1)
+        {
+            ns >>= 1;
+            bucket++;
+        }
+        buckets[bucket]++;
+    }
+
+    uint64_t count() const
+    {
+        uint64_t ret = 0;
+        for (auto c : buckets)
+        {
+            ret += c;
+        }
+        return ret;
+    }
+};
+
+struct monad_stats
+{
+    std::map<std::string, size_t> live_nodes; // keyed by node type, e.g. "promise<int>"
+    uint64_t callbacks_fired = 0;
+    size_t max_chain_depth = 0;
+    monad_latency_histogram resolve_latency;
+    monad_latency_histogram push_latency;
+};
+
+class monad_instrumentation
+{
+    struct node
+    {
+        const std::string *type; // into type_names
+        size_t depth;
+        std::vector<const void *> upstream;
+    };
+
+    std::unordered_map<const void *, node> nodes;
+    monad_stats _stats;
+    // demangled once per kind and type, nodes point into it
+    std::map<std::pair<const char *, std::type_index>, std::string> type_names;
+
+    const std::string *type_name(const char *kind, const std::type_info &type)
+    {
+        auto key = std::make_pair(kind, std::type_index(type));
+        auto it = type_names.find(key);
+        if (it != type_names.end())
+        {
+            return &it->second;
+        }
+        std::string name = type.name();
+#ifdef __GNUG__
+        int status = 0;
+        std::unique_ptr<char, void (*)(void *)> demangled(abi::__cxa_demangle(name.c_str(), nullptr, nullptr, &status), std::free);
+        if (status == 0)
+        {
+            name = demangled.get();
+        }
+#endif
+        return &type_names.emplace(key, std::string(kind) + "<" + name + ">").first->second;
+    }
+
+    // only edges whose upstream node is still alive
+    template <typename Func>
+    void for_each_edge(Func f) const
+    {
+        for (auto &it : nodes)
+        {
+            for (auto upstream : it.second.upstream)
+            {
+                if (nodes.count(upstream))
+                {
+                    f(it.first, upstream);
+                }
+            }
+        }
+    }
+
+public:
+    static monad_instrumentation &get()
+    {
+        static monad_instrumentation instance;
+        return instance;
+    }
+
+    void node_created(const void *ptr, const char *kind, const std::type_info &type)
+    {
+        auto &n = nodes[ptr];
+        n.type = type_name(kind, type);
+        n.depth = 0;
+        n.upstream.clear();
+        _stats.live_nodes[*n.type]++;
+    }
+
+    void node_destroyed(const void *ptr)
+    {
+        auto it = nodes.find(ptr);
+        if (it != nodes.end())
+        {
+            _stats.live_nodes[*it->second.type]--;
+            nodes.erase(it);
+        }
+    }
+
+    void edge_added(const void *downstream, const void *upstream)
+    {
+        auto down = nodes.find(downstream);
+        if (down == nodes.end() || upstream == nullptr)
+        {
+            return;
+        }
+        down->second.upstream.push_back(upstream);
+
+        auto up = nodes.find(upstream);
+        size_t depth = up == nodes.end() ? 1 : up->second.depth + 1;
+        if (depth > down->second.depth)
+        {
+            down->second.depth = depth;
+        }
+        if (depth > _stats.max_chain_depth)
+        {
+            _stats.max_chain_depth = depth;
+        }
+    }
+
+    void edge_removed(const void *downstream, const void *upstream)
+    {
+        auto down = nodes.find(downstream);
+        if (down != nodes.end())
+        {
+            auto &edges = down->second.upstream;
+            auto it = std::find(edges.begin(), edges.end(), upstream);
+            if (it != edges.end())
+            {
+                edges.erase(it);
+            }
+        }
+    }
+
+    void edges_cleared(const void *downstream)
+    {
+        auto down = nodes.find(downstream);
+        if (down != nodes.end())
+        {
+            down->second.upstream.clear();
+        }
+    }
+
+    void callbacks_fired(size_t count)
+    {
+        _stats.callbacks_fired += count;
+    }
+
+    monad_stats &stats() { return _stats; }
+
+    void reset_stats()
+    {
+        auto live_nodes = std::move(_stats.live_nodes);
+        _stats = monad_stats();
+        _stats.live_nodes = std::move(live_nodes);
+    }
+
+    // graphviz, edges point from a node to the upstream node it holds
+    void dump_dot(std::ostream &out) const
+    {
+        out << "digraph monad {\n";
+        for (auto &it : nodes)
+        {
+            out << "  \"" << it.first << "\" [label=\"" << *it.second.type << "\\ndepth " << it.second.depth << "\"];\n";
+        }
+        for_each_edge([&out](const void *downstream, const void *upstream) {
+            out << "  \"" << downstream << "\" -> \"" << upstream << "\";\n";
+        });
+        out << "}\n";
+    }
+
+    void dump_json(std::ostream &out) const
+    {
+        out << "{\"nodes\":[";
+        bool first = true;
+        for (auto &it : nodes)
+        {
+            out << (first ? "" : ",") << "{\"id\":\"" << it.first << "\",\"type\":\"" << *it.second.type << "\",\"depth\":" << it.second.depth << "}";
+            first = false;
+        }
+        out << "],\"edges\":[";
+        first = true;
+        for_each_edge([&out, &first](const void *downstream, const void *upstream) {
+            out << (first ? "" : ",") << "{\"from\":\"" << downstream << "\",\"to\":\"" << upstream << "\"}";
+            first = false;
+        });
+        out << "]}\n";
+    }
+};
+
+// records the lifetime of a scope into a histogram
+class monad_latency_scope
+{
+    monad_latency_histogram &histogram;
+    std::chrono::steady_clock::time_point start;
+public:
+    monad_latency_scope(monad_latency_histogram &histogram) : histogram(histogram), start(std::chrono::steady_clock::now()) {}
+    ~monad_latency_scope()
+    {
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        histogram.record(ns);
+    }
+};
+
+#define MONAD_INSTRUMENT(call) monad_instrumentation::get().call
+#define MONAD_INSTRUMENT_LATENCY(histogram) monad_latency_scope _monad_latency_scope(monad_instrumentation::get().stats().histogram)
+
+#else
+
+#define MONAD_INSTRUMENT(call) do {} while (0)
+#define MONAD_INSTRUMENT_LATENCY(histogram) do {} while (0)
+
+#endif
@@ -1,101 +1,234 @@
 #pragma once
 
+#include <new>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+
+// niche trait
+// a type with a spare bit pattern can use it to mean "no data",
+// so maybe<T> needs no separate flag and is the same size as T.
+// specialize with none() / is_none(), or derive from maybe_sentinel_niche.
+// constructing a maybe from the sentinel value itself yields an empty maybe.
 template <typename T>
-class maybe
+struct maybe_niche
+{
+    static const bool has_niche = false;
+};
+
+template <typename T, T Sentinel>
+struct maybe_sentinel_niche
+{
+    static const bool has_niche = true;
+    static constexpr T none() { return Sentinel; }
+    static constexpr bool is_none(const T &value) { return value == Sentinel; }
+};
+
+// an all-ones address can never point to a T
+template <typename T>
+struct maybe_niche<T *>
+{
+    static const bool has_niche = true;
+    static T *none() { return reinterpret_cast<T *>(~uintptr_t(0)); }
+    static bool is_none(T *value) { return value == none(); }
+};
+
+struct maybe_in_place {};
+
+// true when a single constructor argument is a maybe itself,
+// so the forwarding constructor never hides the copy / move constructors
+template <typename Self, typename... P>
+struct maybe_is_self : std::false_type {};
+
+template <typename Self, typename P>
+struct maybe_is_self<Self, P> : std::is_same<Self, std::decay_t<P>> {};
+
+// storage, general case: T in an aligned union plus a flag
+template <typename T, bool Niche = maybe_niche<T>::has_niche, bool TriviallyDestructible = std::is_trivially_destructible<T>::value>
+struct maybe_storage
 {
-    char buffer[sizeof(T)];
+    static_assert(!Niche, "maybe_niche requires a trivially destructible type");
+
+    union
+    {
+        char _empty;
+        T _value;
+    };
     bool _has_data;
-    
-    void destroy()
+
+    constexpr maybe_storage() : _empty(), _has_data(false) {}
+    template <typename... P>
+    constexpr maybe_storage(maybe_in_place, P &&... params) : _value(std::forward<P>(params)...), _has_data(true) {}
+    ~maybe_storage()
     {
-        if (has_data())
+        reset();
+    }
+
+    constexpr bool has_data() const { return _has_data; }
+
+    template <typename... P>
+    void construct(P &&... params)
+    {
+        new (&_value) T(std::forward<P>(params)...);
+        _has_data = true;
+    }
+
+    void reset()
+    {
+        if (_has_data)
         {
-            get().~T();
+            _value.~T();
         }
         _has_data = false;
     }
-public:
-    maybe() : _has_data(false) {}
+};
+
+// storage, trivially destructible: same layout, trivial destructor
+// an empty one is zero filled, since trivially copyable ones are copied as bytes
+template <typename T>
+struct maybe_storage<T, false, true>
+{
+    union
+    {
+        char _empty[sizeof(T)];
+        T _value;
+    };
+    bool _has_data;
+
+    constexpr maybe_storage() : _empty(), _has_data(false) {}
     template <typename... P>
-    maybe(P... params) : _has_data(true)
+    constexpr maybe_storage(maybe_in_place, P &&... params) : _value(std::forward<P>(params)...), _has_data(true) {}
+
+    constexpr bool has_data() const { return _has_data; }
+
+    template <typename... P>
+    void construct(P &&... params)
     {
-        new (buffer) T(std::forward<P>(params)...);
+        new (&_value) T(std::forward<P>(params)...);
+        _has_data = true;
     }
-    maybe(const maybe &other)
+
+    void reset()
+    {
+        _has_data = false;
+    }
+};
+
+// storage, niche: T only, holding maybe_niche<T>::none() when empty
+template <typename T>
+struct maybe_storage<T, true, true>
+{
+    T _value;
+
+    constexpr maybe_storage() : _value(maybe_niche<T>::none()) {}
+    template <typename... P>
+    constexpr maybe_storage(maybe_in_place, P &&... params) : _value(std::forward<P>(params)...) {}
+
+    constexpr bool has_data() const { return !maybe_niche<T>::is_none(_value); }
+
+    template <typename... P>
+    void construct(P &&... params)
+    {
+        _value = T(std::forward<P>(params)...);
+    }
+
+    void reset()
+    {
+        _value = maybe_niche<T>::none();
+    }
+};
+
+// copy and move, trivial when T is trivially copyable
+template <typename T, bool TriviallyCopyable = std::is_trivially_copyable<T>::value>
+struct maybe_base : maybe_storage<T>
+{
+    using maybe_storage<T>::maybe_storage;
+};
+
+template <typename T>
+struct maybe_base<T, false> : maybe_storage<T>
+{
+    using maybe_storage<T>::maybe_storage;
+
+    maybe_base() = default;
+    maybe_base(const maybe_base &other) : maybe_storage<T>()
     {
-        _has_data = other.has_data();
         if (other.has_data())
         {
-            new (buffer) T(other.get());
+            this->construct(other._value);
         }
     }
-    maybe(maybe &&other)
+    maybe_base(maybe_base &&other)
     {
-        _has_data = other.has_data();
         if (other.has_data())
         {
-            new (buffer) T(std::move(other.get()));
+            this->construct(std::move(other._value));
         }
     }
-    maybe & operator =(const maybe &other)
+    maybe_base & operator =(const maybe_base &other)
     {
         if (other.has_data())
         {
-            if (!has_data())
+            if (!this->has_data())
             {
-                new (buffer) T(other.get());
+                this->construct(other._value);
             }
             else
             {
-                get() = other.get();
+                this->_value = other._value;
             }
         }
         else
         {
-            destroy();
+            this->reset();
         }
-        _has_data = other.has_data();
-        
+
         return *this;
     }
-    maybe & operator =(maybe &&other)
+    maybe_base & operator =(maybe_base &&other)
     {
         if (other.has_data())
         {
-            if (!has_data())
+            if (!this->has_data())
             {
-                new (buffer) T(std::move(other.get()));
+                this->construct(std::move(other._value));
             }
             else
             {
-                get() = std::move(other.get());
+                this->_value = std::move(other._value);
             }
         }
         else
         {
-            destroy();
+            this->reset();
         }
-        _has_data = other.has_data();
-        
+
         return *this;
     }
-    ~maybe()
-    {
-        destroy();
-    }
+};
+
+template <typename T>
+class maybe : private maybe_base<T>
+{
+    using base = maybe_base<T>;
+public:
+    constexpr maybe() = default;
+    template <typename... P
+        , typename _NotSelf = typename std::enable_if<!maybe_is_self<maybe, P...>::value, void>::type
+        >
+    constexpr maybe(P &&... params) : base(maybe_in_place(), std::forward<P>(params)...) {}
 
     template <typename... P>
-    maybe &initialize(P... params)
+    maybe &initialize(P &&... params)
     {
-        destroy();
-        _has_data = true;
-        new (buffer) T(std::forward<P>(params)...);
+        this->reset();
+        this->construct(std::forward<P>(params)...);
 
         return *this;
     }
     
     template <typename P>
-    maybe &assign(P val)
+    maybe &assign(P &&val)
     {
         if (has_data())
         {
@@ -103,16 +236,15 @@ public:
         }
         else
         {
-            new (buffer) T(std::forward<P>(val));
-            _has_data = true;
+            this->construct(std::forward<P>(val));
         }
         
         return *this;
     }
     
-    T &get() { mr_assert(has_data()); return *(T *) buffer; }
-    const T &get() const { mr_assert(has_data()); return *(T *) buffer; }
-    bool has_data() const { return _has_data; }
+    T &get() { mr_assert(has_data()); return this->_value; }
+    constexpr const T &get() const { mr_assert(has_data()); return this->_value; }
+    constexpr bool has_data() const { return base::has_data(); }
 };
 
 
@@ -129,36 +261,72 @@ struct monad<maybe<T>>
     template <typename Func>
     static auto fmap(const M &from, Func f)
     {
-        using From = T;
         using To = decltype(f(std::declval<T>()));
         using RetType = maybe<To>;
-        RetType ret;
         if (from.has_data())
         {
-            ret = f(from.get());
+            return RetType(f(from.get()));
         }
-        return ret;
+        return RetType();
+    }
+
+    // the value of an rvalue maybe is moved into f
+    template <typename Func>
+    static auto fmap(M &&from, Func f)
+    {
+        using To = decltype(f(std::declval<T>()));
+        using RetType = maybe<To>;
+        if (from.has_data())
+        {
+            return RetType(f(std::move(from.get())));
+        }
+        return RetType();
     }
 
     static M join(maybe<M> v)
     {
-        M ret;
         if (v.has_data())
         {
-            ret = v.get();
+            return std::move(v.get());
         }
-        return ret;
+        return M();
     }
 
     static M wrap(T e)
     {
-        return e;
+        return M(std::move(e));
     }
 
-    template <typename Func>
-    static auto bind(M p, Func f)
+    template <typename P, typename Func>
+    static auto bind(P &&p, Func f)
     {
         using RetType = decltype(f(std::declval<T>()));
-        return monad<RetType>::join(fmap(p, [f](auto m) mutable { return f(std::forward<decltype(m)>(m)); }));
+        return monad<RetType>::join(fmap(std::forward<P>(p), std::move(f)));
+    }
+};
+
+// monad apply for maybe, evaluated eagerly:
+// check every input once, then call f with references into the inputs
+template <typename... Ts>
+struct monad_apply_impl<std::tuple<maybe<Ts>...>>
+{
+    using MonadTuple = std::tuple<maybe<Ts>...>;
+
+    template <typename Func>
+    static auto call(const MonadTuple &ms, Func f)
+    {
+        return call(ms, f, std::index_sequence_for<Ts...>());
+    }
+
+private:
+    template <typename Func, size_t... I>
+    static auto call(const MonadTuple &ms, Func &f, std::index_sequence<I...>)
+    {
+        using RetType = maybe<decltype(f(std::declval<Ts>()...))>;
+        if (!monad_all_of({ std::get<I>(ms).has_data()... }))
+        {
+            return RetType();
+        }
+        return RetType(f(std::get<I>(ms).get()...));
     }
 };
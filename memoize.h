@@ -0,0 +1,125 @@
+#pragma once
+
+// memoized functions for fmap stages that see the same inputs over and over
+// memoize<T>(f, capacity) wraps f(const T &) with a bounded least recently used cache
+// keyed by hash and equality of the input. the result is an ordinary function object,
+// so it goes wherever fmap takes one, on observables, promises or any other monad:
+//
+//     auto label = memoize<state>(expensive_label, 16);
+//     auto labels = states > label;
+//     label.stats().hits ...
+//
+// copies share one cache, so a memoized function can serve many promises or stages.
+// not thread safe.
+
+#include <functional>
+#include <list>
+#include <memory>
+#include <type_traits>
+#include <unordered_map>
+#include <utility>
+
+struct memo_stats
+{
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t evictions = 0;
+};
+
+template <typename K, typename V, typename Hash = std::hash<K>, typename Equal = std::equal_to<K>>
+class lru_cache
+{
+    using entry = std::pair<K, V>;
+
+    std::list<entry> entries; // most recently used first
+    std::unordered_map<K, typename std::list<entry>::iterator, Hash, Equal> index;
+    size_t capacity;
+    memo_stats _stats;
+
+public:
+    lru_cache(size_t capacity) : capacity(capacity)
+    {
+        mr_assert(capacity > 0);
+        index.reserve(capacity);
+    }
+
+    // nullptr on a miss
+    const V *find(const K &key)
+    {
+        auto it = index.find(key);
+        if (it == index.end())
+        {
+            _stats.misses++;
+            return nullptr;
+        }
+        _stats.hits++;
+        entries.splice(entries.begin(), entries, it->second);
+        return &it->second->second;
+    }
+
+    const V &insert(K key, V value)
+    {
+        auto it = index.find(key);
+        if (it != index.end())
+        {
+            it->second->second = std::move(value);
+            entries.splice(entries.begin(), entries, it->second);
+            return it->second->second;
+        }
+        if (entries.size() >= capacity)
+        {
+            index.erase(entries.back().first);
+            entries.pop_back();
+            _stats.evictions++;
+        }
+        entries.emplace_front(std::move(key), std::move(value));
+        index.emplace(entries.front().first, entries.begin());
+        return entries.front().second;
+    }
+
+    void clear()
+    {
+        entries.clear();
+        index.clear();
+    }
+
+    size_t size() const { return entries.size(); }
+    const memo_stats &stats() const { return _stats; }
+};
+
+template <typename T, typename Func, typename Hash = std::hash<T>, typename Equal = std::equal_to<T>>
+class memoized
+{
+    using R = std::decay_t<decltype(std::declval<Func &>()(std::declval<const T &>()))>;
+
+    struct state
+    {
+        Func f;
+        lru_cache<T, R, Hash, Equal> cache;
+
+        state(Func f, size_t capacity) : f(std::move(f)), cache(capacity) {}
+    };
+    std::shared_ptr<state> s;
+
+public:
+    memoized(Func f, size_t capacity) : s(std::make_shared<state>(std::move(f), capacity)) {}
+
+    R operator () (const T &input) const
+    {
+        if (const R *cached = s->cache.find(input))
+        {
+            return *cached;
+        }
+        return s->cache.insert(input, s->f(input));
+    }
+
+    const memo_stats &stats() const { return s->cache.stats(); }
+    size_t size() const { return s->cache.size(); }
+    void clear() { s->cache.clear(); }
+};
+
+template <typename T, typename Hash = std::hash<T>, typename Equal = std::equal_to<T>, typename Func>
+memoized<T, Func, Hash, Equal> memoize(Func f, size_t capacity)
+{
+    return memoized<T, Func, Hash, Equal>(std::move(f), capacity);
+}
@@ -0,0 +1,250 @@
+#pragma once
+
+// streams a memory mapped file into an observable without copying it
+// pushed values are spans into the mapping; each span keeps the mapping alive, so
+// they can be held onto for as long as needed. pages already streamed are dropped
+// from the process (they are read back from the page cache if a span is touched
+// again), which keeps memory flat for files larger than ram.
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "event_loop.h"
+#include "file_io.h"
+
+// a read only, shared mapping of a whole file
+class mapped_file
+{
+    const char *_data = nullptr;
+    size_t _size = 0;
+
+    mapped_file() = default;
+
+    DISALLOW_COPY_AND_ASSIGN(mapped_file);
+public:
+    using ptr = std::shared_ptr<const mapped_file>;
+
+    static result<ptr, io_error> open(const std::string &path)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0)
+        {
+            return result<ptr, io_error>(Error, io_error { errno });
+        }
+        struct stat st;
+        if (fstat(fd, &st) < 0)
+        {
+            int code = errno;
+            close(fd);
+            return result<ptr, io_error>(Error, io_error { code });
+        }
+
+        std::shared_ptr<mapped_file> file(new mapped_file());
+        file->_size = size_t(st.st_size);
+        if (file->_size > 0)
+        {
+            void *data = mmap(nullptr, file->_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (data == MAP_FAILED)
+            {
+                int code = errno;
+                close(fd);
+                return result<ptr, io_error>(Error, io_error { code });
+            }
+            file->_data = static_cast<const char *>(data);
+            madvise(data, file->_size, MADV_SEQUENTIAL);
+        }
+        close(fd); // the mapping stays valid
+        return result<ptr, io_error>(Ok, std::move(file));
+    }
+
+    ~mapped_file()
+    {
+        if (_data)
+        {
+            munmap(const_cast<char *>(_data), _size);
+        }
+    }
+
+    const char *data() const { return _data; }
+    size_t size() const { return _size; }
+
+    // page aligned madvise over [offset, offset + length)
+    void advise(size_t offset, size_t length, int advice) const
+    {
+        if (!_data || offset >= _size)
+        {
+            return;
+        }
+        size_t page = size_t(sysconf(_SC_PAGESIZE));
+        size_t begin = offset / page * page;
+        size_t end = std::min(offset + length, _size);
+        if (end > begin)
+        {
+            madvise(const_cast<char *>(_data) + begin, end - begin, advice);
+        }
+    }
+};
+
+// string_view like window into a mapped file
+class mapped_span
+{
+    mapped_file::ptr file;
+    const char *_data = nullptr;
+    size_t _size = 0;
+public:
+    mapped_span() = default;
+    mapped_span(mapped_file::ptr file, size_t offset, size_t size)
+        : file(std::move(file)), _data(this->file->data() + offset), _size(size) {}
+
+    const char *data() const { return _data; }
+    size_t size() const { return _size; }
+    bool empty() const { return _size == 0; }
+    const char *begin() const { return _data; }
+    const char *end() const { return _data + _size; }
+    char operator [] (size_t index) const { return _data[index]; }
+
+    // offset of the span in the file
+    size_t offset() const { return file ? size_t(_data - file->data()) : 0; }
+
+    mapped_span sub(size_t offset, size_t size) const
+    {
+        return mapped_span(file, this->offset() + offset, size);
+    }
+
+    std::string str() const { return std::string(_data, _size); }
+};
+
+// calls f with every record of `span` (without the delimiter); a trailing partial record is included
+template <typename Func>
+void for_each_record(const mapped_span &span, char delimiter, Func f)
+{
+    size_t start = 0;
+    while (start < span.size())
+    {
+        const void *found = memchr(span.data() + start, delimiter, span.size() - start);
+        size_t end = found ? size_t(static_cast<const char *>(found) - span.data()) : span.size();
+        f(span.sub(start, end - start));
+        start = end + 1;
+    }
+}
+
+struct mmap_stream_options
+{
+    enum class mode { chunks, records };
+
+    mode push = mode::chunks;
+    size_t chunk_size = 1 << 20;
+    // chunks end after the last delimiter that fits, so records are never split
+    // (a record longer than chunk_size gets a chunk of its own); -1 for fixed size chunks. records mode always splits on it.
+    int delimiter = '\n';
+    size_t readahead_chunks = 4;
+    bool drop_behind = true;
+};
+
+// pushes the file chunk by chunk (or record by record) into an observable
+// that starts out holding an empty span
+class mmap_stream
+{
+    mapped_file::ptr file;
+    mmap_stream_options options;
+    size_t offset = 0;
+    size_t advised = 0; // readahead requested up to here
+    size_t dropped = 0; // pages dropped up to here
+    observable_ptr<mapped_span> out;
+
+    size_t chunk_end() const
+    {
+        size_t end = std::min(offset + options.chunk_size, file->size());
+        if (options.delimiter >= 0 && end < file->size())
+        {
+            for (size_t i = end; i > offset; i--)
+            {
+                if (file->data()[i - 1] == char(options.delimiter))
+                {
+                    return i;
+                }
+            }
+            // a record longer than a chunk gets a longer chunk, up to its delimiter
+            const void *found = memchr(file->data() + end, options.delimiter, file->size() - end);
+            return found ? size_t(static_cast<const char *>(found) - file->data()) + 1 : file->size();
+        }
+        return end;
+    }
+
+    void readahead()
+    {
+        size_t window = options.readahead_chunks * options.chunk_size;
+        if (window > 0 && advised < std::min(offset + window, file->size()))
+        {
+            size_t from = std::max(advised, offset);
+            file->advise(from, offset + window - from, MADV_WILLNEED);
+            advised = offset + window;
+        }
+    }
+
+public:
+    mmap_stream(mapped_file::ptr file, mmap_stream_options options = mmap_stream_options())
+        : file(std::move(file)), options(options), out(observable<mapped_span>::create(mapped_span()))
+    {
+        mr_assert(this->options.chunk_size > 0);
+    }
+
+    observable_ptr<mapped_span> get_observable() const { return out; }
+    bool done() const { return offset >= file->size(); }
+    size_t position() const { return offset; }
+
+    // pushes the next chunk, or each record in it; false once the whole file is streamed
+    bool next()
+    {
+        if (done())
+        {
+            return false;
+        }
+        readahead();
+        size_t start = offset;
+        size_t end = chunk_end();
+        offset = end;
+        mapped_span chunk(file, start, end - start);
+        if (options.push == mmap_stream_options::mode::records && options.delimiter >= 0)
+        {
+            for_each_record(chunk, char(options.delimiter), [this](const mapped_span &record) {
+                out->push(record);
+            });
+        }
+        else
+        {
+            out->push(std::move(chunk));
+        }
+        if (options.drop_behind)
+        {
+            // whole pages behind the chunk just pushed
+            size_t page = size_t(sysconf(_SC_PAGESIZE));
+            size_t behind = start / page * page;
+            if (behind > dropped)
+            {
+                file->advise(dropped, behind - dropped, MADV_DONTNEED);
+                dropped = behind;
+            }
+        }
+        return !done();
+    }
+
+    // one chunk per loop iteration, so other work on the loop is not starved;
+    // the stream must outlive the loop run
+    void run(event_loop &loop)
+    {
+        loop.post([this, &loop]() {
+            if (next())
+            {
+                run(loop);
+            }
+        });
+    }
+};
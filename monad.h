@@ -1,9 +1,11 @@
 #pragma once
 
 #include <vector>
+#include <memory>
 #include <tuple>
 #include <type_traits>
 #include <utility>
+#include <initializer_list>
 
 template <typename M>
 struct monad
@@ -12,32 +14,37 @@ struct monad
 };
 
 // operator overloading for bind and fmap
+// the monad is forwarded, so rvalue monads can be consumed by fmap / bind
 template <typename M, typename Func
-    , typename _MustBeMonad = typename std::enable_if<monad<M>::has_monad, void>::type
+    , typename _MustBeMonad = typename std::enable_if<monad<std::decay_t<M>>::has_monad, void>::type
     >
-auto operator >=(M m, Func f)
+auto operator >=(M &&m, Func f)
 {
-    return monad<M>::bind(m, f);
+    return monad<std::decay_t<M>>::bind(std::forward<M>(m), std::move(f));
 }
 
 template <typename M, typename Func
-    , typename _MustBeMonad = typename std::enable_if<monad<M>::has_monad, void>::type
+    , typename _MustBeMonad = typename std::enable_if<monad<std::decay_t<M>>::has_monad, void>::type
     >
-auto operator >(M m, Func f)
+auto operator >(M &&m, Func f)
 {
-    return monad<M>::fmap(m, f);
+    return monad<std::decay_t<M>>::fmap(std::forward<M>(m), std::move(f));
 }
 
 template <typename A, typename M_A, typename V_A, typename M_V_A, typename... Other>
 struct monad_sequence_helper
 {
+    // the input vector is shared by every step instead of copied into each one
+    using MonadVector = std::shared_ptr<const std::vector<M_A, Other...>>;
+
     // [a] -> [Monad a] -> int -> Monad [a]
-    static M_V_A call(V_A out, std::vector<M_A, Other...> vec, size_t index)
+    static M_V_A call(V_A out, MonadVector vec, size_t index)
     {
-        if (index < vec.size())
+        if (index < vec->size())
         {
             // Monad a >>= (a -> Monad [a]) -> Monad [a]
-            return vec[index] >= [out = std::move(out), vec = std::move(vec), index](const auto &a) mutable {
+            const M_A &m = (*vec)[index];
+            return m >= [out = std::move(out), vec = std::move(vec), index](const auto &a) mutable {
                 auto new_out = out; // must make a copy, if it's a list monad
                 new_out.push_back(a);
                 return call(std::move(new_out), vec, index + 1);
@@ -57,15 +64,15 @@ auto monad_sequence(std::vector<T, Other...> t)
     using A = typename monad<T>::ElemType;
     using V_A = std::vector<A>; // [a]
     using M_V_A = typename monad<T>::template OtherType<V_A>;
-    V_A out;
-    return monad_sequence_helper<A, T, V_A, M_V_A, Other...>::call(out, std::move(t), 0);
+    using Helper = monad_sequence_helper<A, T, V_A, M_V_A, Other...>;
+    return Helper::call(V_A(), std::make_shared<const std::vector<T, Other...>>(std::move(t)), 0);
 }
 
 // monad apply
 template <typename Func, typename Tuple, size_t... I>
-auto monad_apply_func_tuple(Func f, Tuple tuple, std::index_sequence<I...>)
+auto monad_apply_func_tuple(Func &f, Tuple &&tuple, std::index_sequence<I...>)
 {
-    return f(std::forward<typename std::tuple_element<I, Tuple>::type>(std::get<I>(tuple))...);
+    return f(std::get<I>(std::forward<Tuple>(tuple))...);
 }
 
 template <int N, typename Func, typename MonadTuple, typename OutTuple>
@@ -74,7 +81,9 @@ struct monad_apply_helper
     static auto call(MonadTuple ms, Func f, OutTuple out_tuple)
     {
         constexpr int Index = std::tuple_size<MonadTuple>::value - N;
-        return std::get<Index>(ms) >= [ms = std::move(ms), f = std::move(f), out_tuple = std::move(out_tuple)](const auto &a) mutable {
+        // copy out before ms is moved into the continuation
+        auto m = std::get<Index>(ms);
+        return std::move(m) >= [ms = std::move(ms), f = std::move(f), out_tuple = std::move(out_tuple)](const auto &a) mutable {
             auto new_out_tuple = std::tuple_cat(out_tuple, std::make_tuple(a));
             return monad_apply_helper<N - 1, Func, MonadTuple, decltype(new_out_tuple)>::call(ms, f, std::move(new_out_tuple));
         };
@@ -92,7 +101,32 @@ struct monad_apply_helper<0, Func, MonadTuple, OutTuple>
         auto result = monad_apply_func_tuple(f, std::move(out_tuple), std::make_index_sequence<N>());
 
         using FirstMonadType = typename std::tuple_element<0, MonadTuple>::type;
-        return monad<typename monad<FirstMonadType>::template OtherType<decltype(result)>>::wrap(result);
+        return monad<typename monad<FirstMonadType>::template OtherType<decltype(result)>>::wrap(std::move(result));
+    }
+};
+
+// true if every flag is set, for checking a whole parameter pack in one pass
+constexpr bool monad_all_of(std::initializer_list<bool> flags)
+{
+    for (bool flag : flags)
+    {
+        if (!flag)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// generic monad apply by nested binds
+// specialize for monads that can apply f directly
+template <typename MonadTuple>
+struct monad_apply_impl
+{
+    template <typename Func>
+    static auto call(MonadTuple ms, Func f)
+    {
+        return monad_apply_helper<std::tuple_size<MonadTuple>::value, Func, MonadTuple, std::tuple<>>::call(std::move(ms), std::move(f), std::make_tuple());
     }
 };
 
@@ -100,21 +134,21 @@ struct monad_apply_helper<0, Func, MonadTuple, OutTuple>
 template <typename Func, typename... Ms>
 auto monad_apply(std::tuple<Ms...> ms, Func f)
 {
-    return monad_apply_helper<sizeof...(Ms), Func, std::tuple<Ms...>, std::tuple<>>::call(std::move(ms), std::move(f), std::make_tuple());
+    return monad_apply_impl<std::tuple<Ms...>>::call(std::move(ms), std::move(f));
 }
 
 // (m a1, m a2, ...., m an) -> (a1 -> a2 -> ... -> an -> out) -> m out
 template <typename Func, typename... Ms>
 auto operator >(std::tuple<Ms...> ms, Func f)
 {
-    return monad_apply(ms, f);
+    return monad_apply(std::move(ms), std::move(f));
 }
 
 // (m a1, m a2, ...., m an) -> (a1 -> a2 -> ... -> an -> m out) -> m out
 template <typename Func, typename... Ms>
 auto operator >=(std::tuple<Ms...> ms, Func f)
 {
-    auto ret = monad_apply(ms, f); // type: m m out
-    return monad<typename monad<decltype(ret)>::ElemType>::join(ret);
+    auto ret = monad_apply(std::move(ms), std::move(f)); // type: m m out
+    return monad<typename monad<decltype(ret)>::ElemType>::join(std::move(ret));
 }
 
@@ -1,7 +1,59 @@
 #include <vector>
+#include <iterator>
 
 #include "monad.h"
 
+// output storage for vector monad results
+// trivial element types are built by the vector's range constructor from a generator,
+// which sizes the storage once and writes each element once, without zero filling it first
+template <typename T>
+struct vector_preallocatable
+{
+    static const bool value = std::is_trivially_default_constructible<T>::value
+        && std::is_trivially_copy_assignable<T>::value
+        && !std::is_same<T, bool>::value; // std::vector<bool> is packed
+};
+
+// a range whose elements come from gen.next(), one call per element, read once and in order
+template <typename Gen>
+class vector_generator_iterator
+{
+public:
+    using iterator_category = std::forward_iterator_tag;
+    using value_type = decltype(std::declval<Gen &>().next());
+    using difference_type = std::ptrdiff_t;
+    using pointer = const value_type *;
+    using reference = value_type;
+
+    vector_generator_iterator(Gen &gen, size_t position) : gen(&gen), position(position) {}
+
+    value_type operator *() const { return gen->next(); }
+    vector_generator_iterator &operator ++() { ++position; return *this; }
+    vector_generator_iterator operator ++(int) { auto ret = *this; ++position; return ret; }
+    bool operator ==(const vector_generator_iterator &other) const { return position == other.position; }
+    bool operator !=(const vector_generator_iterator &other) const { return position != other.position; }
+
+private:
+    Gen *gen;
+    size_t position;
+};
+
+template <typename Gen>
+auto vector_generate(Gen &gen, size_t size)
+{
+    using T = decltype(gen.next());
+    return std::vector<T>(vector_generator_iterator<Gen>(gen, 0), vector_generator_iterator<Gen>(gen, size));
+}
+
+template <typename It, typename Func>
+struct vector_fmap_generator
+{
+    It it;
+    Func &f;
+
+    auto next() { return f(*it++); }
+};
+
 template <typename T>
 struct monad<std::vector<T>>
 {
@@ -12,28 +64,29 @@ struct monad<std::vector<T>>
     template <typename Func>
     static auto fmap(const M &from, Func f)
     {
-        using From = T;
-        using To = decltype(f(std::declval<T>()));
-        auto ret = std::vector<To>();
-        ret.reserve(from.size());
-
-        for (auto &elem : from)
-        {
-            ret.push_back(f(elem));
-        }
+        return fmap_range(from.begin(), from.end(), from.size(), f);
+    }
 
-        return ret;
+    // elements of an rvalue vector are moved into f
+    template <typename Func>
+    static auto fmap(M &&from, Func f)
+    {
+        return fmap_range(std::make_move_iterator(from.begin()), std::make_move_iterator(from.end()), from.size(), f);
     }
 
     static M join(std::vector<M> v)
     {
+        size_t size = 0;
+        for (auto &row : v)
+        {
+            size += row.size();
+        }
+
         M ret;
+        ret.reserve(size);
         for (auto &row : v)
         {
-            for (auto &elem : row)
-            {
-                ret.push_back(elem);
-            }
+            ret.insert(ret.end(), std::make_move_iterator(row.begin()), std::make_move_iterator(row.end()));
         }
         return ret;
     }
@@ -45,11 +98,124 @@ struct monad<std::vector<T>>
         return ret;
     }
 
-    template <typename Func>
-    static auto bind(M p, Func f)
+    template <typename P, typename Func>
+    static auto bind(P &&p, Func f)
     {
         using RetType = decltype(f(std::declval<T>()));
-        return monad<RetType>::join(fmap(p, [f](auto m) mutable { return f(std::forward<decltype(m)>(m)); }));
+        return monad<RetType>::join(fmap(std::forward<P>(p), std::move(f)));
+    }
+
+private:
+    template <typename It, typename Func>
+    static auto fmap_range(It begin, It end, size_t size, Func &f)
+    {
+        using To = decltype(f(*begin));
+        return fmap_range(begin, end, size, f, std::integral_constant<bool, vector_preallocatable<To>::value>());
+    }
+
+    template <typename It, typename Func>
+    static auto fmap_range(It begin, It, size_t size, Func &f, std::true_type)
+    {
+        vector_fmap_generator<It, Func> gen{ begin, f };
+        return vector_generate(gen, size);
+    }
+
+    template <typename It, typename Func>
+    static auto fmap_range(It begin, It end, size_t size, Func &f, std::false_type)
+    {
+        std::vector<decltype(f(*begin))> ret;
+        ret.reserve(size);
+        for (; begin != end; ++begin)
+        {
+            ret.push_back(f(*begin));
+        }
+        return ret;
+    }
+};
+
+// monad apply for vectors, i.e. f over the cartesian product of all inputs
+// written directly into the output instead of nesting binds and joins;
+// the innermost loop runs over the last vector with all other arguments fixed
+// and appends that whole row at once
+template <size_t Index, size_t N, bool Row = Index + 1 == N>
+struct vector_apply_loop
+{
+    template <typename To, typename Func, typename VecTuple, typename... A>
+    static void call(std::vector<To> &out, Func &f, const VecTuple &vs, const A &... args)
+    {
+        for (auto &elem : std::get<Index>(vs))
+        {
+            vector_apply_loop<Index + 1, N>::call(out, f, vs, args..., elem);
+        }
     }
 };
 
+template <size_t Index, size_t N>
+struct vector_apply_loop<Index, N, true>
+{
+    template <typename To, typename Func, typename VecTuple, typename... A>
+    static void call(std::vector<To> &out, Func &f, const VecTuple &vs, const A &... args)
+    {
+        auto &row = std::get<Index>(vs);
+        auto g = [&](const auto &elem) { return f(args..., elem); };
+        append_row(out, row, g, std::integral_constant<bool, vector_preallocatable<To>::value>());
+    }
+
+private:
+    template <typename To, typename Row, typename Func>
+    static void append_row(std::vector<To> &out, const Row &row, Func &g, std::true_type)
+    {
+        using It = typename Row::const_iterator;
+        vector_fmap_generator<It, Func> gen{ row.begin(), g };
+        out.insert(out.end(), vector_generator_iterator<decltype(gen)>(gen, 0), vector_generator_iterator<decltype(gen)>(gen, row.size()));
+    }
+
+    template <typename To, typename Row, typename Func>
+    static void append_row(std::vector<To> &out, const Row &row, Func &g, std::false_type)
+    {
+        for (auto &elem : row)
+        {
+            out.push_back(g(elem));
+        }
+    }
+};
+
+// no inputs at all: f is called once
+template <>
+struct vector_apply_loop<0, 0, false>
+{
+    template <typename To, typename Func, typename VecTuple>
+    static void call(std::vector<To> &out, Func &f, const VecTuple &)
+    {
+        out.push_back(f());
+    }
+};
+
+template <typename... Ts>
+struct monad_apply_impl<std::tuple<std::vector<Ts>...>>
+{
+    using MonadTuple = std::tuple<std::vector<Ts>...>;
+
+    template <typename Func>
+    static auto call(const MonadTuple &ms, Func f)
+    {
+        using To = decltype(f(std::declval<const Ts &>()...));
+        std::vector<To> ret;
+        ret.reserve(product_size(ms, std::index_sequence_for<Ts...>()));
+        vector_apply_loop<0, sizeof...(Ts)>::call(ret, f, ms);
+        return ret;
+    }
+
+private:
+    template <size_t... I>
+    static size_t product_size(const MonadTuple &ms, std::index_sequence<I...>)
+    {
+        size_t sizes[] = { std::get<I>(ms).size()... };
+        size_t ret = 1;
+        for (auto size : sizes)
+        {
+            ret *= size;
+        }
+        return ret;
+    }
+};
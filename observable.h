@@ -1,10 +1,52 @@
 #pragma once
 
+#include <cassert>
 #include <memory>
 #include <list>
 #include <functional>
+#include <map>
+#include <type_traits>
+#include <vector>
 
 #include "generic_holder.h"
+#include "instrumentation.h"
+#include "scheduler.h"
+
+// describes an in place change of a T, for observers that update incrementally
+// instead of recomputing from the whole value; specialized per type
+struct no_delta {};
+
+template <typename T>
+struct observable_delta
+{
+    using type = no_delta;
+};
+
+// indices of the elements assigned in place; the size is unchanged
+struct vector_delta
+{
+    std::vector<size_t> changed;
+};
+
+template <typename E, typename A>
+struct observable_delta<std::vector<E, A>>
+{
+    using type = vector_delta;
+};
+
+// keys inserted or assigned, and keys erased
+template <typename K>
+struct map_delta
+{
+    std::vector<K> changed;
+    std::vector<K> erased;
+};
+
+template <typename K, typename V, typename C, typename A>
+struct observable_delta<std::map<K, V, C, A>>
+{
+    using type = map_delta<K>;
+};
 
 class base_observable
 {
@@ -17,15 +59,25 @@ class base_observable_callback_handle
 {
 public:
     virtual ~base_observable_callback_handle() = default;
+    // the observed observable, for instrumentation; declared with or without it,
+    // so the class layout does not depend on MONAD_INSTRUMENTATION
+    virtual const base_observable *source() const { return nullptr; }
 };
 using base_observable_callback_handle_ptr = std::unique_ptr<base_observable_callback_handle>;
 using observable_callback_handle_holder = generic_holder<base_observable_callback_handle_ptr>;
 
-// listener list
+// listener list, in tag order, newest first among equal tags
 template <typename T>
 class observable_callback_list
 {
-    using handler_t = typename std::list<T>::iterator;
+public:
+    struct entry
+    {
+        T item;
+        continuation_tag tag;
+    };
+private:
+    using handler_t = typename std::list<entry>::iterator;
 public:
     struct handle : public base_observable_callback_handle
     {
@@ -68,6 +120,11 @@ public:
             observable.reset();
         }
 
+        const base_observable *source() const override
+        {
+            return observable.get();
+        }
+
         std::unique_ptr<handle> to_ptr()
         {
             std::unique_ptr<handle> ret(new handle(std::move(*this)));
@@ -75,13 +132,18 @@ public:
         }
     };
     
-    handle add(base_observable_ptr observable, T item)
+    handle add(base_observable_ptr observable, T item, const continuation_tag &tag)
     {
-        _list.push_front(item);
-        return handle(observable, this, _list.begin());
+        auto it = _list.begin();
+        while (it != _list.end() && it->tag.before(tag))
+        {
+            ++it;
+        }
+        it = _list.insert(it, entry { std::move(item), tag });
+        return handle(std::move(observable), this, it);
     }
     
-    const std::list<T> &get()
+    const std::list<entry> &get()
     {
         return _list;
     }
@@ -93,7 +155,7 @@ public:
         while (it != _list.end())
         {
             next = std::next(it);
-            if (*it == nullptr)
+            if (it->item == nullptr)
             {
                 _list.erase(it);
             }
@@ -114,12 +176,12 @@ private:
         }
         else
         {
-            *handle = nullptr;
+            handle->item = nullptr;
             _unregistered_during_fire = true;
         }
     }
     
-    std::list<T> _list;
+    std::list<entry> _list;
 };
 
 template <typename T>
@@ -130,6 +192,7 @@ class observable : public base_observable, public std::enable_shared_from_this<o
 
     T data;
     mutable observable_callback_list<data_cb> callbacks;
+    const typename observable_delta<T>::type *firing_delta = nullptr;
 
     observable_callback_handle_holder callback_holder;
     
@@ -148,22 +211,35 @@ class observable : public base_observable, public std::enable_shared_from_this<o
 
 public:
     using ResultType = T;
+    using DeltaType = typename observable_delta<T>::type;
     using CallbackHandle = typename observable_callback_list<data_cb>::handle;
 
-    observable() = default;
-    observable(T data) : data(std::move(data)) {}
+    observable()
+    {
+        MONAD_INSTRUMENT(node_created(static_cast<base_observable *>(this), "observable", typeid(T)));
+    }
+    observable(T data) : data(std::move(data))
+    {
+        MONAD_INSTRUMENT(node_created(static_cast<base_observable *>(this), "observable", typeid(T)));
+    }
     ~observable()
     {
         call_finally();
+        MONAD_INSTRUMENT(node_destroyed(static_cast<base_observable *>(this)));
     }
 
     CallbackHandle observe(data_cb cb, bool call_with_initial_value = false)
+    {
+        return observe(std::move(cb), continuation_scheduler::get().current(), call_with_initial_value);
+    }
+
+    CallbackHandle observe(data_cb cb, const continuation_tag &tag, bool call_with_initial_value = false)
     {
         if (call_with_initial_value)
         {
             cb(get());
         }
-        return callbacks.add(this->shared_from_this(), cb);
+        return callbacks.add(this->shared_from_this(), std::move(cb), tag);
     }
     
     void finally(void_cb cb)
@@ -172,24 +248,117 @@ public:
         // reserved to be used by observable owner only
         mr_assert(finally_cb == nullptr);
         
-        finally_cb = cb;
+        finally_cb = std::move(cb);
     }
 
     void push(T new_data)
     {
+        MONAD_INSTRUMENT_LATENCY(push_latency);
         data = std::move(new_data);
-        
+        notify(nullptr);
+    }
+
+    // changes the value in place with f(T &) instead of building a new one;
+    // if f returns a DeltaType it is handed to observers as delta()
+    template <typename Func>
+    void modify(Func f)
+    {
+        MONAD_INSTRUMENT_LATENCY(push_latency);
+        modify(f, std::is_void<decltype(f(data))>());
+    }
+
+    // sets the value without notifying observers, for state restored from elsewhere
+    // (see observable_snapshot) that is already consistent downstream
+    void restore(T value)
+    {
+        data = std::move(value);
+    }
+
+    // the delta of the change being delivered to observers,
+    // nullptr if the whole value may have changed
+    const DeltaType *delta() const
+    {
+        return firing_delta;
+    }
+
+    const T &get()
+    {
+        return data;
+    }
+
+private:
+    template <typename Func>
+    void modify(Func &f, std::true_type)
+    {
+        f(data);
+        notify(nullptr);
+    }
+
+    template <typename Func>
+    void modify(Func &f, std::false_type)
+    {
+        DeltaType delta = f(data);
+        notify(&delta);
+    }
+
+    void notify(const DeltaType *delta)
+    {
+        auto &scheduler = continuation_scheduler::get();
+        if (scheduler.is_deferring())
+        {
+            // data may be pushed again before the callbacks run, so they get this value
+            std::shared_ptr<const DeltaType> delta_copy;
+            if (delta != nullptr)
+            {
+                delta_copy = std::make_shared<DeltaType>(*delta);
+            }
+            scheduler.dispatch([self = this->shared_from_this(), value = data, delta_copy]() {
+                self->fire_callbacks(value, delta_copy.get());
+            }, first_tag());
+        }
+        else
+        {
+            scheduler.dispatch([this, delta]() {
+                fire_callbacks(data, delta);
+            }, first_tag());
+        }
+    }
+
+    // the tag of the callback to run first
+    continuation_tag first_tag() const
+    {
+        for (auto &it : callbacks.get())
+        {
+            if (it.item != nullptr)
+            {
+                return it.tag;
+            }
+        }
+        return continuation_scheduler::get().current();
+    }
+
+    void fire_callbacks(const T &value, const DeltaType *delta)
+    {
+        auto &scheduler = continuation_scheduler::get();
+        struct restore
+        {
+            const DeltaType *&current;
+            const DeltaType *saved;
+            ~restore() { current = saved; }
+        } guard { firing_delta, firing_delta };
+        firing_delta = delta;
         callbacks._in_fire_count++;
         auto it = callbacks.get().begin();
         auto next = it;
         while (it != callbacks.get().end())
         {
             next = std::next(it);
-            if (*it != nullptr)
+            if (it->item != nullptr)
             {
+                MONAD_INSTRUMENT(callbacks_fired(1));
                 try
                 {
-                    (*it)(data);
+                    scheduler.run_tagged(it->tag, [&it, &value]() { it->item(value); });
                 }
                 catch (const std::bad_function_call &e)
                 {
@@ -207,18 +376,17 @@ public:
         }
     }
 
-    const T &get()
-    {
-        return data;
-    }
+public:
 
     void hold_handle(base_observable_callback_handle_ptr ptr)
     {
+        MONAD_INSTRUMENT(edge_added(static_cast<base_observable *>(this), ptr->source()));
         callback_holder.hold(std::move(ptr));
     }
     
     void clear_all_held_handles()
     {
+        MONAD_INSTRUMENT(edges_cleared(static_cast<base_observable *>(this)));
         callback_holder.clear();
     }
 
@@ -267,7 +435,7 @@ struct monad<observable_ptr<T>>
         auto ret_observable = observable<To>::create(f(from->get()));
         observable_weak_ptr<To> weak_ret_observable(ret_observable);
 
-        ret_observable->hold_handle(from->observe([weak_ret_observable, f](const From &data) mutable {
+        ret_observable->hold_handle(from->observe([weak_ret_observable, f = std::move(f)](const From &data) mutable {
             auto o = weak_ret_observable.lock();
             if (o)
             {
@@ -309,6 +477,101 @@ struct monad<observable_ptr<T>>
     static auto bind(M p, Func f)
     {
         using RetType = decltype(f(std::declval<T>()));
-        return monad<RetType>::join(fmap(p, [f](auto m) mutable { return f(std::forward<decltype(m)>(m)); }));
+        return monad<RetType>::join(fmap(std::move(p), std::move(f)));
     }
 };
+
+// fmap that keeps its output up to date in place: full(const T &) computes it from
+// scratch, update(U &out, const T &in, const DeltaType &delta) applies a change
+// that came with a delta, and may return the output's delta for the next stage
+template <typename T, typename Full, typename Update>
+auto fmap_delta(observable_ptr<T> from, Full full, Update update)
+{
+    using To = decltype(full(std::declval<T>()));
+    auto ret_observable = observable<To>::create(full(from->get()));
+    observable_weak_ptr<To> weak_ret_observable(ret_observable);
+
+    // the callback only runs while `from` is alive
+    const observable<T> *source = from.get();
+    ret_observable->hold_handle(from->observe([weak_ret_observable, source, full = std::move(full), update = std::move(update)](const T &data) mutable {
+        auto o = weak_ret_observable.lock();
+        if (!o)
+        {
+            return;
+        }
+        auto delta = source->delta();
+        if (delta == nullptr)
+        {
+            o->push(full(data));
+        }
+        else
+        {
+            o->modify([&](To &out) { return update(out, data, *delta); });
+        }
+    }).to_ptr());
+
+    return ret_observable;
+}
+
+// maps each element, and only the changed ones on a vector_delta
+template <typename E, typename A, typename Func>
+auto fmap_elements(observable_ptr<std::vector<E, A>> from, Func f)
+{
+    using To = decltype(f(std::declval<E>()));
+    auto shared_f = std::make_shared<Func>(std::move(f));
+    auto full = [shared_f](const std::vector<E, A> &items) {
+        std::vector<To> out;
+        out.reserve(items.size());
+        for (auto &item : items)
+        {
+            out.push_back((*shared_f)(item));
+        }
+        return out;
+    };
+    return fmap_delta(std::move(from), full, [shared_f, full](std::vector<To> &out, const std::vector<E, A> &items, const vector_delta &delta) {
+        if (out.size() != items.size())
+        {
+            // a vector_delta cannot resize, so the whole output is recomputed
+            out = full(items);
+            vector_delta all;
+            all.changed.reserve(out.size());
+            for (size_t index = 0; index < out.size(); index++)
+            {
+                all.changed.push_back(index);
+            }
+            return all;
+        }
+        for (size_t index : delta.changed)
+        {
+            out[index] = (*shared_f)(items[index]);
+        }
+        return delta;
+    });
+}
+
+// maps each value, and only the changed ones on a map_delta
+template <typename K, typename V, typename C, typename A, typename Func>
+auto fmap_values(observable_ptr<std::map<K, V, C, A>> from, Func f)
+{
+    using To = decltype(f(std::declval<V>()));
+    auto shared_f = std::make_shared<Func>(std::move(f));
+    auto full = [shared_f](const std::map<K, V, C, A> &items) {
+        std::map<K, To, C> out;
+        for (auto &item : items)
+        {
+            out.emplace_hint(out.end(), item.first, (*shared_f)(item.second));
+        }
+        return out;
+    };
+    return fmap_delta(std::move(from), full, [shared_f](std::map<K, To, C> &out, const std::map<K, V, C, A> &items, const map_delta<K> &delta) {
+        for (auto &key : delta.erased)
+        {
+            out.erase(key);
+        }
+        for (auto &key : delta.changed)
+        {
+            out[key] = (*shared_f)(items.at(key));
+        }
+        return delta;
+    });
+}
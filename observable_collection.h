@@ -0,0 +1,401 @@
+#pragma once
+
+// keyed collections of entities that report every insert, update and erase,
+// with fmap / filter / sort stages that apply those changes one element at a time:
+// a single change costs O(log n) downstream instead of recomputing the whole
+// mapped vector as fmap over an observable<std::vector<E>> does.
+
+#include <functional>
+#include <map>
+#include <memory>
+#include <set>
+#include <utility>
+
+#include "observable.h"
+
+template <typename K, typename E>
+struct collection_change
+{
+    enum class kind { insert, update, erase };
+
+    kind op;
+    const K &key;
+    const E *item; // the new item, nullptr on erase
+    const K *next; // the key the element now sits before in the collection's order, nullptr at the end or on erase
+};
+
+// listeners of a collection, and the handles it holds on its sources
+template <typename K, typename E>
+class collection_notifier : public base_observable, public std::enable_shared_from_this<collection_notifier<K, E>>
+{
+public:
+    using KeyType = K;
+    using ItemType = E;
+    using change = collection_change<K, E>;
+    using change_cb = std::function<void(const change &)>;
+    using CallbackHandle = typename observable_callback_list<change_cb>::handle;
+
+private:
+    observable_callback_list<change_cb> callbacks;
+    observable_callback_handle_holder callback_holder;
+
+    continuation_tag first_tag()
+    {
+        for (auto &it : callbacks.get())
+        {
+            if (it.item != nullptr)
+            {
+                return it.tag;
+            }
+        }
+        return continuation_scheduler::get().current();
+    }
+
+    void fire_callbacks(const change &c)
+    {
+        auto &scheduler = continuation_scheduler::get();
+        callbacks._in_fire_count++;
+        auto it = callbacks.get().begin();
+        auto next = it;
+        while (it != callbacks.get().end())
+        {
+            next = std::next(it);
+            if (it->item != nullptr)
+            {
+                MONAD_INSTRUMENT(callbacks_fired(1));
+                scheduler.run_tagged(it->tag, [&it, &c]() { it->item(c); });
+            }
+            it = next;
+        }
+        callbacks._in_fire_count--;
+
+        if (callbacks._in_fire_count == 0 && callbacks._unregistered_during_fire)
+        {
+            callbacks.clear_nullptr();
+            callbacks._unregistered_during_fire = false;
+        }
+    }
+
+protected:
+    collection_notifier(const char *kind)
+    {
+        (void) kind; // unused without instrumentation
+        MONAD_INSTRUMENT(node_created(static_cast<base_observable *>(this), kind, typeid(E)));
+    }
+
+    void notify(typename change::kind op, const K &key, const E *item, const K *next)
+    {
+        if (callbacks.get().empty())
+        {
+            return;
+        }
+        auto &scheduler = continuation_scheduler::get();
+        if (scheduler.is_deferring())
+        {
+            // the element may change again before the callbacks run, so they get copies
+            std::shared_ptr<const E> item_copy = item ? std::make_shared<E>(*item) : nullptr;
+            std::shared_ptr<const K> next_copy = next ? std::make_shared<K>(*next) : nullptr;
+            scheduler.dispatch([self = this->shared_from_this(), op, key, item_copy, next_copy]() {
+                self->fire_callbacks(change { op, key, item_copy.get(), next_copy.get() });
+            }, first_tag());
+        }
+        else
+        {
+            scheduler.dispatch([&]() {
+                fire_callbacks(change { op, key, item, next });
+            }, first_tag());
+        }
+    }
+
+public:
+    ~collection_notifier()
+    {
+        MONAD_INSTRUMENT(node_destroyed(static_cast<base_observable *>(this)));
+    }
+
+    CallbackHandle observe(change_cb cb)
+    {
+        return observe(std::move(cb), continuation_scheduler::get().current());
+    }
+
+    CallbackHandle observe(change_cb cb, const continuation_tag &tag)
+    {
+        return callbacks.add(this->shared_from_this(), std::move(cb), tag);
+    }
+
+    void hold_handle(base_observable_callback_handle_ptr ptr)
+    {
+        MONAD_INSTRUMENT(edge_added(static_cast<base_observable *>(this), ptr->source()));
+        callback_holder.hold(std::move(ptr));
+    }
+
+    int observer_count()
+    {
+        return int(callbacks.get().size());
+    }
+};
+
+// entities by key, in key order
+template <typename K, typename E>
+class observable_collection : public collection_notifier<K, E>
+{
+    using change = collection_change<K, E>;
+
+    std::map<K, E> items;
+
+    observable_collection() : collection_notifier<K, E>("observable_collection") {}
+
+    DISALLOW_COPY_AND_ASSIGN(observable_collection);
+
+    const K *next_key(typename std::map<K, E>::const_iterator it) const
+    {
+        ++it;
+        return it == items.end() ? nullptr : &it->first;
+    }
+
+public:
+    static std::shared_ptr<observable_collection> create()
+    {
+        return std::shared_ptr<observable_collection>(new observable_collection());
+    }
+
+    // inserts or updates
+    void set(const K &key, E item)
+    {
+        auto it = items.lower_bound(key);
+        typename change::kind op = change::kind::update;
+        if (it == items.end() || items.key_comp()(key, it->first))
+        {
+            it = items.emplace_hint(it, key, std::move(item));
+            op = change::kind::insert;
+        }
+        else
+        {
+            it->second = std::move(item);
+        }
+        this->notify(op, it->first, &it->second, next_key(it));
+    }
+
+    bool erase(const K &key)
+    {
+        auto it = items.find(key);
+        if (it == items.end())
+        {
+            return false;
+        }
+        K erased = it->first; // `key` may refer to the element
+        items.erase(it);
+        this->notify(change::kind::erase, erased, nullptr, nullptr);
+        return true;
+    }
+
+    const std::map<K, E> &get() const
+    {
+        return items;
+    }
+
+    const E *find(const K &key) const
+    {
+        auto it = items.find(key);
+        return it == items.end() ? nullptr : &it->second;
+    }
+
+    size_t size() const
+    {
+        return items.size();
+    }
+
+    template <typename Func>
+    void for_each(Func f) const
+    {
+        for (auto &it : items)
+        {
+            f(it.first, it.second);
+        }
+    }
+};
+
+template <typename K, typename E>
+using observable_collection_ptr = std::shared_ptr<observable_collection<K, E>>;
+
+// entities ordered by `less` on the items, then by key; changes report their
+// neighbour in that order as `next`, for views that keep a sorted list
+template <typename K, typename E, typename Less>
+class sorted_collection : public collection_notifier<K, E>
+{
+    using change = collection_change<K, E>;
+    using value_type = typename std::map<K, E>::value_type;
+
+    struct order
+    {
+        Less less;
+        bool operator () (const value_type *a, const value_type *b) const
+        {
+            if (less(a->second, b->second))
+            {
+                return true;
+            }
+            if (less(b->second, a->second))
+            {
+                return false;
+            }
+            return std::less<K>()(a->first, b->first);
+        }
+    };
+
+    std::map<K, E> items;
+    std::set<const value_type *, order> sorted; // points into items, whose nodes do not move
+
+    sorted_collection(Less less) : collection_notifier<K, E>("sorted_collection"), sorted(order { std::move(less) }) {}
+
+    DISALLOW_COPY_AND_ASSIGN(sorted_collection);
+
+    const K *next_key(typename std::set<const value_type *, order>::const_iterator it) const
+    {
+        ++it;
+        return it == sorted.end() ? nullptr : &(*it)->first;
+    }
+
+public:
+    static std::shared_ptr<sorted_collection> create(Less less)
+    {
+        return std::shared_ptr<sorted_collection>(new sorted_collection(std::move(less)));
+    }
+
+    void apply(const change &c)
+    {
+        auto it = items.find(c.key);
+        if (it != items.end())
+        {
+            // out of the order before the item it is sorted by changes
+            sorted.erase(&*it);
+        }
+        if (c.op == change::kind::erase)
+        {
+            if (it != items.end())
+            {
+                K erased = it->first;
+                items.erase(it);
+                this->notify(change::kind::erase, erased, nullptr, nullptr);
+            }
+            return;
+        }
+        typename change::kind op = change::kind::update;
+        if (it == items.end())
+        {
+            it = items.emplace(c.key, *c.item).first;
+            op = change::kind::insert;
+        }
+        else
+        {
+            it->second = *c.item;
+        }
+        auto position = sorted.insert(&*it).first;
+        this->notify(op, it->first, &it->second, next_key(position));
+    }
+
+    size_t size() const
+    {
+        return items.size();
+    }
+
+    // in sorted order
+    template <typename Func>
+    void for_each(Func f) const
+    {
+        for (auto *it : sorted)
+        {
+            f(it->first, it->second);
+        }
+    }
+};
+
+template <typename K, typename E, typename Less>
+using sorted_collection_ptr = std::shared_ptr<sorted_collection<K, E, Less>>;
+
+// stages take any collection (observable_collection, sorted_collection or another stage's output)
+
+// f runs once per inserted or updated element
+template <typename Source, typename Func>
+auto collection_fmap(std::shared_ptr<Source> from, Func f)
+{
+    using K = typename Source::KeyType;
+    using E = typename Source::ItemType;
+    using To = decltype(f(std::declval<E>()));
+    auto ret_collection = observable_collection<K, To>::create();
+    from->for_each([&](const K &key, const E &item) {
+        ret_collection->set(key, f(item));
+    });
+    std::weak_ptr<observable_collection<K, To>> weak_ret_collection(ret_collection);
+    ret_collection->hold_handle(from->observe([weak_ret_collection, f = std::move(f)](const collection_change<K, E> &c) mutable {
+        auto o = weak_ret_collection.lock();
+        if (!o)
+        {
+            return;
+        }
+        if (c.op == collection_change<K, E>::kind::erase)
+        {
+            o->erase(c.key);
+        }
+        else
+        {
+            o->set(c.key, f(*c.item));
+        }
+    }).to_ptr());
+    return ret_collection;
+}
+
+// the elements for which pred holds; an update can move an element in or out
+template <typename Source, typename Pred>
+auto collection_filter(std::shared_ptr<Source> from, Pred pred)
+{
+    using K = typename Source::KeyType;
+    using E = typename Source::ItemType;
+    auto ret_collection = observable_collection<K, E>::create();
+    from->for_each([&](const K &key, const E &item) {
+        if (pred(item))
+        {
+            ret_collection->set(key, item);
+        }
+    });
+    std::weak_ptr<observable_collection<K, E>> weak_ret_collection(ret_collection);
+    ret_collection->hold_handle(from->observe([weak_ret_collection, pred = std::move(pred)](const collection_change<K, E> &c) mutable {
+        auto o = weak_ret_collection.lock();
+        if (!o)
+        {
+            return;
+        }
+        if (c.op != collection_change<K, E>::kind::erase && pred(*c.item))
+        {
+            o->set(c.key, *c.item);
+        }
+        else
+        {
+            o->erase(c.key);
+        }
+    }).to_ptr());
+    return ret_collection;
+}
+
+// less(const E &, const E &) orders the output; usually the last stage, as the
+// ones after it see the elements in key order again
+template <typename Source, typename Less>
+auto collection_sort(std::shared_ptr<Source> from, Less less)
+{
+    using K = typename Source::KeyType;
+    using E = typename Source::ItemType;
+    using change = collection_change<K, E>;
+    auto ret_collection = sorted_collection<K, E, Less>::create(std::move(less));
+    from->for_each([&](const K &key, const E &item) {
+        ret_collection->apply(change { change::kind::insert, key, &item, nullptr });
+    });
+    std::weak_ptr<sorted_collection<K, E, Less>> weak_ret_collection(ret_collection);
+    ret_collection->hold_handle(from->observe([weak_ret_collection](const change &c) {
+        auto o = weak_ret_collection.lock();
+        if (o)
+        {
+            o->apply(c);
+        }
+    }).to_ptr());
+    return ret_collection;
+}
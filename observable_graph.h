@@ -0,0 +1,212 @@
+#pragma once
+
+// compact observable nodes for very large graphs (spreadsheet cells and the like)
+// an observable<T> costs a separate heap object with a shared_ptr control block,
+// a std::list of callbacks, a handle holder and a std::function per stage. here every
+// node of a graph lives in one arena owned by the graph: a node is its value plus
+// four 32 bit fields, edges are 8 bytes, and formulas are shared between nodes.
+//
+// nodes are addressed by id. a node's inputs exist before it, so ids are a
+// topological order: a push recomputes each affected node once, in id order,
+// after all of its inputs are up to date (no glitches on diamonds, unlike a
+// chain of observables). observers are kept aside, for the few nodes that have one.
+
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <queue>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+template <typename T>
+class observable_graph
+{
+public:
+    using node_id = uint32_t;
+    using formula_id = uint32_t;
+    using formula = std::function<T(const T *inputs, size_t count)>;
+    using observer = std::function<void(const T &)>;
+
+private:
+    static const uint32_t none = UINT32_MAX;
+    static const uint32_t no_formula = (1u << 30) - 1;
+
+    struct node
+    {
+        T value;
+        uint32_t first_input;     // into inputs
+        uint32_t input_count;
+        uint32_t first_dependent; // into edges, a singly linked list
+        uint32_t formula : 30;
+        uint32_t dirty : 1;
+        uint32_t observed : 1;
+    };
+
+    struct edge
+    {
+        node_id target;
+        uint32_t next;
+    };
+
+    std::vector<node> nodes;
+    std::vector<node_id> inputs;
+    std::vector<edge> edges;
+    std::vector<formula> formulas;
+    std::unordered_map<node_id, std::vector<observer>> observers;
+
+    // reused by every push
+    std::priority_queue<node_id, std::vector<node_id>, std::greater<node_id>> pending;
+    std::vector<T> scratch;
+
+    void mark_dependents(node_id id)
+    {
+        for (uint32_t e = nodes[id].first_dependent; e != none; e = edges[e].next)
+        {
+            node &dependent = nodes[edges[e].target];
+            if (!dependent.dirty)
+            {
+                dependent.dirty = 1;
+                pending.push(edges[e].target);
+            }
+        }
+    }
+
+    void recompute(node_id id)
+    {
+        node &n = nodes[id];
+        scratch.clear();
+        for (uint32_t i = 0; i < n.input_count; i++)
+        {
+            scratch.push_back(nodes[inputs[n.first_input + i]].value);
+        }
+        n.value = formulas[n.formula](scratch.data(), scratch.size());
+    }
+
+    void notify(node_id id)
+    {
+        if (nodes[id].observed)
+        {
+            auto &list = observers[id];
+            for (size_t i = 0; i < list.size(); i++)
+            {
+                list[i](nodes[id].value);
+            }
+        }
+    }
+
+    DISALLOW_COPY_AND_ASSIGN(observable_graph);
+public:
+    observable_graph() = default;
+
+    void reserve(size_t node_count, size_t edge_count)
+    {
+        nodes.reserve(node_count);
+        inputs.reserve(edge_count);
+        edges.reserve(edge_count);
+    }
+
+    // a source node
+    node_id add(T value)
+    {
+        mr_assert(nodes.size() < none);
+        nodes.push_back(node { std::move(value), 0, 0, none, no_formula, 0, 0 });
+        return node_id(nodes.size() - 1);
+    }
+
+    // a formula can be shared by any number of nodes
+    formula_id add_formula(formula f)
+    {
+        mr_assert(formulas.size() < no_formula);
+        formulas.push_back(std::move(f));
+        return formula_id(formulas.size() - 1);
+    }
+
+    // a node computed by `f` from the values of `from`, in order
+    node_id add(formula_id f, const node_id *from, size_t count)
+    {
+        mr_assert(f < formulas.size());
+        uint32_t first_input = uint32_t(inputs.size());
+        for (size_t i = 0; i < count; i++)
+        {
+            mr_assert(from[i] < nodes.size());
+            inputs.push_back(from[i]);
+        }
+        node_id id = add(T());
+        node &n = nodes[id];
+        n.first_input = first_input;
+        n.input_count = uint32_t(count);
+        n.formula = f;
+        for (size_t i = 0; i < count; i++)
+        {
+            node &input = nodes[from[i]];
+            edges.push_back(edge { id, input.first_dependent });
+            input.first_dependent = uint32_t(edges.size() - 1);
+        }
+        recompute(id);
+        return id;
+    }
+
+    node_id add(formula_id f, std::initializer_list<node_id> from)
+    {
+        return add(f, from.begin(), from.size());
+    }
+
+    // single input node with a formula of its own
+    template <typename Func>
+    node_id fmap(node_id from, Func f)
+    {
+        formula_id fid = add_formula([f = std::move(f)](const T *inputs, size_t) mutable {
+            return f(inputs[0]);
+        });
+        return add(fid, &from, 1);
+    }
+
+    const T &get(node_id id) const
+    {
+        return nodes[id].value;
+    }
+
+    // sets the value of any node and recomputes everything downstream of it
+    void push(node_id id, T value)
+    {
+        nodes[id].value = std::move(value);
+        notify(id);
+        mark_dependents(id);
+        while (!pending.empty())
+        {
+            node_id next = pending.top();
+            pending.pop();
+            nodes[next].dirty = 0;
+            recompute(next);
+            notify(next);
+            mark_dependents(next);
+        }
+    }
+
+    void observe(node_id id, observer cb)
+    {
+        nodes[id].observed = 1;
+        observers[id].push_back(std::move(cb));
+    }
+
+    void clear_observers(node_id id)
+    {
+        nodes[id].observed = 0;
+        observers.erase(id);
+    }
+
+    size_t size() const
+    {
+        return nodes.size();
+    }
+
+    // bytes held by the arenas, excluding formulas and observers
+    size_t memory_bytes() const
+    {
+        return nodes.capacity() * sizeof(node) + inputs.capacity() * sizeof(node_id) + edges.capacity() * sizeof(edge);
+    }
+
+    static constexpr size_t node_bytes = sizeof(node);
+    static constexpr size_t edge_bytes = sizeof(edge) + sizeof(node_id);
+};
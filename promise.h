@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <functional>
 #include <deque>
 #include <vector>
@@ -8,6 +9,8 @@
 
 #include "maybe.h"
 #include "generic_holder.h"
+#include "instrumentation.h"
+#include "scheduler.h"
 
 class base_promise
 {
@@ -18,6 +21,8 @@ using base_promise_ptr = std::shared_ptr<base_promise>;
 
 using promise_holder = generic_holder<base_promise_ptr>;
 
+class promise_batch;
+
 template <typename T>
 class promise : public base_promise, public std::enable_shared_from_this<promise<T>>
 {
@@ -25,17 +30,25 @@ class promise : public base_promise, public std::enable_shared_from_this<promise
     using void_cb = std::function<void()>;
     
     maybe<T> data;
+    bool batched = false; // data stored by a promise_batch that has not resolved yet
     
     mutable resolve_cb then_cb; // optimization when only one `then`
-    mutable std::deque<resolve_cb> other_then_cbs;
+    mutable continuation_tag then_tag;
+    mutable std::deque<std::pair<continuation_tag, resolve_cb>> other_then_cbs; // in tag order
     
     void_cb finally_cb; // optimization when only one `finally_cb`
     std::deque<void_cb> other_finally_cbs;
     
     promise_holder holder;
     
-    promise() = default;
-    promise(T data) : data(std::move(data)) {}
+    promise()
+    {
+        MONAD_INSTRUMENT(node_created(static_cast<base_promise *>(this), "promise", typeid(T)));
+    }
+    promise(T data) : data(std::move(data))
+    {
+        MONAD_INSTRUMENT(node_created(static_cast<base_promise *>(this), "promise", typeid(T)));
+    }
     DISALLOW_COPY_AND_ASSIGN(promise);
     
     void call_finally()
@@ -60,21 +73,35 @@ public:
     ~promise()
     {
         call_finally();
+        MONAD_INSTRUMENT(node_destroyed(static_cast<base_promise *>(this)));
     }
     
     void then(resolve_cb cb) const
     {
-        if (data.has_data())
+        then(std::move(cb), continuation_scheduler::get().current());
+    }
+
+    void then(resolve_cb cb, const continuation_tag &tag) const
+    {
+        if (is_finished())
         {
-            cb(result());
+            continuation_scheduler::get().dispatch([self = this->shared_from_this(), cb = std::move(cb)]() {
+                MONAD_INSTRUMENT(callbacks_fired(1));
+                cb(self->result());
+            }, tag);
         }
         else if (then_cb == nullptr)
         {
             then_cb = std::move(cb);
+            then_tag = tag;
         }
         else
         {
-            other_then_cbs.emplace_back(std::move(cb));
+            // stable: after every callback that does not run later than this one
+            auto it = std::find_if(other_then_cbs.begin(), other_then_cbs.end(), [&tag](const std::pair<continuation_tag, resolve_cb> &other) {
+                return tag.before(other.first);
+            });
+            other_then_cbs.emplace(it, tag, std::move(cb));
         }
     }
     
@@ -86,7 +113,7 @@ public:
         
         if (finally_cb == nullptr)
         {
-            finally_cb = cb;
+            finally_cb = std::move(cb);
         }
         else
         {
@@ -95,34 +122,95 @@ public:
     }
     
     template <typename... P>
-    void resolve(P... params)
+    void resolve(P &&... params)
     {
         mr_assert(!data.has_data());
+        MONAD_INSTRUMENT_LATENCY(resolve_latency);
         data.initialize(std::forward<P>(params)...);
-        
-        if (then_cb != nullptr)
+        schedule_callbacks();
+    }
+
+private:
+    friend class promise_batch;
+
+    void schedule_callbacks()
+    {
+        // a continuation may release the last reference to this promise
+        // (see hold_promise), so stay alive until they have all run
+        continuation_scheduler::get().dispatch_call(this->shared_from_this(), [](void *self) {
+            static_cast<promise *>(self)->fire_callbacks();
+        }, first_tag());
+    }
+
+    // the tag of the callback to run first
+    continuation_tag first_tag() const
+    {
+        if (then_cb == nullptr)
         {
-            then_cb(result());
+            return continuation_scheduler::get().current();
         }
-        for (auto &cb : other_then_cbs)
+        if (!other_then_cbs.empty() && other_then_cbs.front().first.before(then_tag))
         {
-            cb(result());
+            return other_then_cbs.front().first;
+        }
+        return then_tag;
+    }
+
+    void fire_callbacks()
+    {
+        MONAD_INSTRUMENT(callbacks_fired((then_cb != nullptr ? 1 : 0) + other_then_cbs.size()));
+        auto &scheduler = continuation_scheduler::get();
+        auto call = [this, &scheduler](const continuation_tag &tag, resolve_cb &cb) {
+            scheduler.run_tagged(tag, [this, &cb]() { cb(result()); });
+        };
+        // then_cb was registered first, it goes before others with the same tag
+        bool then_cb_called = then_cb == nullptr;
+        for (auto &it : other_then_cbs)
+        {
+            if (!then_cb_called && !it.first.before(then_tag))
+            {
+                call(then_tag, then_cb);
+                then_cb_called = true;
+            }
+            call(it.first, it.second);
+        }
+        if (!then_cb_called)
+        {
+            call(then_tag, then_cb);
         }
         
         call_finally();
         
         then_cb = nullptr;
         other_then_cbs.clear();
+
+        // upstream promises are only needed until this one has a result
+        MONAD_INSTRUMENT(edges_cleared(static_cast<base_promise *>(this)));
+        holder.clear();
     }
-    
+
+public:
+    // keep an upstream promise alive until this promise is resolved
     void hold_promise(base_promise_ptr promise)
     {
-        holder.hold(promise);
+        if (is_finished())
+        {
+            return;
+        }
+        MONAD_INSTRUMENT(edge_added(static_cast<base_promise *>(this), promise.get()));
+        holder.hold(std::move(promise));
+    }
+
+    // stop keeping `promise` alive before this one resolves, e.g. once it has resolved itself
+    void release_promise(const base_promise *promise)
+    {
+        MONAD_INSTRUMENT(edge_removed(static_cast<base_promise *>(this), promise));
+        holder.release_if([promise](const base_promise_ptr &held) { return held.get() == promise; });
     }
 
     T &result() { return data.get(); }
     const T &result() const { return data.get(); }
-    bool is_finished() const { return data.has_data(); }
+    bool is_finished() const { return data.has_data() && !batched; }
     
     std::weak_ptr<promise> get_weak()
     {
@@ -145,6 +233,105 @@ using promise_ptr = std::shared_ptr<promise<T>>;
 template <typename T>
 using promise_weak_ptr = std::weak_ptr<promise<T>>;
 
+// resolves many promises at once, for bulk completions
+// every value is stored first, then the callbacks of all the batch's promises run in
+// one pass, without the per promise scheduling of resolve(). with the trampoline on,
+// what those callbacks resolve is queued, so the chains advance one stage at a time
+// instead of one chain after another.
+// until resolve(), the promises are not finished and `then` only registers.
+// a batch resolves whatever is left in it when destroyed.
+class promise_batch
+{
+    enum class step { finish, fire, schedule };
+
+    struct entry
+    {
+        base_promise_ptr p;
+        void (*run)(base_promise *p, step s);
+    };
+    std::vector<entry> entries;
+
+    template <typename T>
+    static void run(base_promise *p, step s)
+    {
+        auto self = static_cast<promise<T> *>(p);
+        switch (s)
+        {
+            case step::finish: self->batched = false; break;
+            case step::fire: self->fire_callbacks(); break;
+            case step::schedule: self->schedule_callbacks(); break;
+        }
+    }
+
+public:
+    promise_batch() = default;
+    DISALLOW_COPY_AND_ASSIGN(promise_batch);
+
+    ~promise_batch()
+    {
+        resolve();
+    }
+
+    void reserve(size_t count) { entries.reserve(count); }
+    size_t size() const { return entries.size(); }
+
+    // stores the value now, continuations wait for resolve()
+    template <typename T, typename... P>
+    void add(const promise_ptr<T> &p, P &&... params)
+    {
+        mr_assert(!p->data.has_data());
+        p->data.initialize(std::forward<P>(params)...);
+        p->batched = true;
+        entries.push_back(entry { p, &run<T> });
+    }
+
+    void resolve()
+    {
+        if (entries.empty())
+        {
+            return;
+        }
+        std::vector<entry> batch = std::move(entries);
+        entries.clear();
+        for (auto &e : batch)
+        {
+            e.run(e.p.get(), step::finish);
+        }
+
+        auto &scheduler = continuation_scheduler::get();
+        if (scheduler.is_deferring())
+        {
+            // from inside a continuation, queued to run after it
+            for (auto &e : batch)
+            {
+                e.run(e.p.get(), step::schedule);
+            }
+        }
+        else
+        {
+            // the batch holds every promise, so they are fired directly, not queued
+            scheduler.dispatch([&batch]() {
+                for (auto &e : batch)
+                {
+                    e.run(e.p.get(), step::fire);
+                }
+            });
+        }
+    }
+};
+
+template <typename T>
+void resolve_all(std::vector<std::pair<promise_ptr<T>, T>> values)
+{
+    promise_batch batch;
+    batch.reserve(values.size());
+    for (auto &it : values)
+    {
+        batch.add(it.first, std::move(it.second));
+    }
+    batch.resolve();
+}
+
 
 // monad implementation
 #include "monad.h"
@@ -164,14 +351,14 @@ struct monad<promise_ptr<T>>
         auto ret_promise = promise<To>::create();
         promise_weak_ptr<To> weak_ret_promise(ret_promise);
 
-        from->then([weak_ret_promise, f](const From &data) mutable {
+        from->then([weak_ret_promise, f = std::move(f)](const From &data) mutable {
             auto p = weak_ret_promise.lock();
             if (p)
             {
                 p->resolve(f(data));
             }
         });
-        ret_promise->hold_promise(from);
+        ret_promise->hold_promise(std::move(from));
 
         return ret_promise;
     }
@@ -194,7 +381,7 @@ struct monad<promise_ptr<T>>
                 ret_promise->hold_promise(inner_p);
             }
         });
-        ret_promise->hold_promise(p);
+        ret_promise->hold_promise(std::move(p));
         return ret_promise;
     }
 
@@ -207,7 +394,7 @@ struct monad<promise_ptr<T>>
     static auto bind(M p, Func f)
     {
         using RetType = decltype(f(std::declval<T>()));
-        return monad<RetType>::join(fmap(p, [f](auto m) mutable { return f(std::forward<decltype(m)>(m)); }));
+        return monad<RetType>::join(fmap(std::move(p), std::move(f)));
     }
 };
 
@@ -233,7 +420,7 @@ struct monad<promise_ptr<result<T, E>>>
         auto ret_promise = promise<RetType>::create();
         promise_weak_ptr<RetType> weak_ret_promise(ret_promise);
 
-        from->then([weak_ret_promise, f](const Result &data) mutable {
+        from->then([weak_ret_promise, f = std::move(f)](const Result &data) mutable {
             auto p = weak_ret_promise.lock();
             if (p)
             {
@@ -248,7 +435,7 @@ struct monad<promise_ptr<result<T, E>>>
                 }
             }
         });
-        ret_promise->hold_promise(from);
+        ret_promise->hold_promise(std::move(from));
 
         return ret_promise;
     }
@@ -269,12 +456,12 @@ struct monad<promise_ptr<result<T, E>>>
                         {
                             if (data.is_ok())
                             {
-                                ret_promise->resolve(Result(Ok, data.ok()));
+                                ret_promise->resolve(Ok, data.ok());
                             }
                             else
                             {
                                 mr_assert(data.is_error());
-                                ret_promise->resolve(Result(Error, data.error()));
+                                ret_promise->resolve(Error, data.error());
                             }
                         }
                     });
@@ -283,11 +470,11 @@ struct monad<promise_ptr<result<T, E>>>
                 else
                 {
                     mr_assert(inner_p.is_error());
-                    ret_promise->resolve(Result(Error, inner_p.error()));
+                    ret_promise->resolve(Error, inner_p.error());
                 }
             }
         });
-        ret_promise->hold_promise(p);
+        ret_promise->hold_promise(std::move(p));
         return ret_promise;
     }
 
@@ -300,6 +487,127 @@ struct monad<promise_ptr<result<T, E>>>
     static auto bind(M p, Func f)
     {
         using RetType = decltype(f(std::declval<T>()));
-        return monad<RetType>::join(fmap(p, [f](auto m) mutable { return f(std::forward<decltype(m)>(m)); }));
+        return monad<RetType>::join(fmap(std::move(p), std::move(f)));
+    }
+};
+
+// monad apply for promises: subscribes to every input at once, with one aggregate
+// node instead of a join per input, and calls f when the last one resolves.
+// promise<result> inputs with a common error type fail fast: the first error to
+// arrive resolves the result and releases the other inputs.
+
+// true if every T is a result<U, E> with the same E
+template <typename... Ts>
+struct promise_apply_fail_fast : std::false_type {};
+template <typename E, typename... Us>
+struct promise_apply_fail_fast<result<Us, E>...> : std::true_type {};
+
+// the inputs' values as they arrive
+template <typename RetType, typename Func, typename... Ts>
+struct promise_apply_state
+{
+    std::tuple<maybe<Ts>...> values;
+    size_t remaining = sizeof...(Ts);
+    Func f;
+    promise_weak_ptr<RetType> ret_promise;
+
+    promise_apply_state(Func f, promise_weak_ptr<RetType> ret_promise) : f(std::move(f)), ret_promise(std::move(ret_promise)) {}
+
+    // input I arrived; calls f once all have
+    template <size_t I, typename T>
+    void arrived(const T &data)
+    {
+        std::get<I>(values).initialize(data);
+        if (--remaining == 0)
+        {
+            complete(std::index_sequence_for<Ts...>());
+        }
+    }
+
+    template <size_t... I>
+    void complete(std::index_sequence<I...>)
+    {
+        auto p = ret_promise.lock();
+        if (p && !p->is_finished())
+        {
+            p->resolve(f(std::move(std::get<I>(values).get())...));
+        }
+    }
+};
+
+template <typename... Ts>
+struct monad_apply_impl<std::tuple<promise_ptr<Ts>...>>
+{
+    using MonadTuple = std::tuple<promise_ptr<Ts>...>;
+
+    template <typename Func>
+    static auto call(const MonadTuple &ms, Func f)
+    {
+        return call(ms, std::move(f), promise_apply_fail_fast<Ts...>(), std::index_sequence_for<Ts...>());
+    }
+
+private:
+    template <typename Func, size_t... I>
+    static auto call(const MonadTuple &ms, Func f, std::false_type, std::index_sequence<I...>)
+    {
+        using To = decltype(f(std::declval<Ts>()...));
+        using State = promise_apply_state<To, Func, Ts...>;
+        auto ret_promise = promise<To>::create();
+        auto state = std::make_shared<State>(std::move(f), ret_promise);
+        (void) std::initializer_list<int> { (subscribe<I>(state, std::get<I>(ms)), 0)... };
+        (void) std::initializer_list<int> { (ret_promise->hold_promise(std::get<I>(ms)), 0)... };
+        return ret_promise;
+    }
+
+    template <typename Func, size_t... I>
+    static auto call(const MonadTuple &ms, Func f, std::true_type, std::index_sequence<I...>)
+    {
+        return fail_fast(ms, std::move(f), std::get<I>(ms)...);
+    }
+
+    template <typename Func, typename E, typename... Us>
+    static auto fail_fast(const MonadTuple &ms, Func f, const promise_ptr<result<Us, E>> &...)
+    {
+        using RetType = result<decltype(f(std::declval<Us>()...)), E>;
+        auto ok = [f = std::move(f)](auto &&... values) mutable {
+            return RetType(Ok, f(std::forward<decltype(values)>(values)...));
+        };
+        using State = promise_apply_state<RetType, decltype(ok), Us...>;
+        auto ret_promise = promise<RetType>::create();
+        auto state = std::make_shared<State>(std::move(ok), ret_promise);
+        subscribe_all(state, ret_promise, ms, std::index_sequence_for<Ts...>());
+        return ret_promise;
+    }
+
+    template <typename State, typename RetPromise, size_t... I>
+    static void subscribe_all(const std::shared_ptr<State> &state, const RetPromise &ret_promise, const MonadTuple &ms, std::index_sequence<I...>)
+    {
+        (void) std::initializer_list<int> { (subscribe_result<I>(state, std::get<I>(ms)), 0)... };
+        (void) std::initializer_list<int> { (ret_promise->hold_promise(std::get<I>(ms)), 0)... };
+    }
+
+    template <size_t I, typename State, typename T>
+    static void subscribe(const std::shared_ptr<State> &state, const promise_ptr<T> &p)
+    {
+        p->then([state](const T &data) { state->template arrived<I>(data); });
+    }
+
+    template <size_t I, typename State, typename U, typename E>
+    static void subscribe_result(const std::shared_ptr<State> &state, const promise_ptr<result<U, E>> &p)
+    {
+        p->then([state](const result<U, E> &data) {
+            if (data.is_ok())
+            {
+                state->template arrived<I>(data.ok());
+                return;
+            }
+            auto ret_promise = state->ret_promise.lock();
+            if (ret_promise && !ret_promise->is_finished())
+            {
+                mr_assert(data.is_error());
+                using RetType = typename decltype(ret_promise)::element_type::ResultType;
+                ret_promise->resolve(RetType(Error, data.error()));
+            }
+        });
     }
 };
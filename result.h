@@ -1,145 +1,364 @@
 #pragma once
 
+#include <new>
+#include <cstdint>
+#include <type_traits>
+#include <utility>
+
 class _Ok {};
 class _Error {};
 constexpr _Ok Ok{};
 constexpr _Error Error{};
 
-template <typename Ok, typename Error>
-class result
+enum class result_which : uint8_t {
+    NONE, OK, ERROR
+};
+
+// storage, general case: both alternatives in an aligned union plus a one byte tag
+template <typename Ok, typename Error, bool TriviallyDestructible = std::is_trivially_destructible<Ok>::value && std::is_trivially_destructible<Error>::value>
+struct result_storage
 {
-    char buffer[std::max(sizeof(Ok), sizeof(Error))];
-    enum class e_which {
-        NONE, OK, ERROR
+    union
+    {
+        char _none;
+        Ok _ok;
+        Error _error;
     };
-    e_which which;
-    
+    result_which which;
+
+    constexpr result_storage() : _none(), which(result_which::NONE) {}
+    template <typename... T>
+    constexpr result_storage(_Ok, T &&... params) : _ok(std::forward<T>(params)...), which(result_which::OK) {}
+    template <typename... T>
+    constexpr result_storage(_Error, T &&... params) : _error(std::forward<T>(params)...), which(result_which::ERROR) {}
+    ~result_storage()
+    {
+        destroy();
+    }
+
+    template <typename... T>
+    void construct_ok(T &&... params)
+    {
+        new (&_ok) Ok(std::forward<T>(params)...);
+        which = result_which::OK;
+    }
+
+    template <typename... T>
+    void construct_error(T &&... params)
+    {
+        new (&_error) Error(std::forward<T>(params)...);
+        which = result_which::ERROR;
+    }
+
     void destroy()
     {
-        if (is_ok())
+        if (which == result_which::OK)
         {
-            this->ok().~Ok();
+            _ok.~Ok();
         }
-        else if (is_error())
+        else if (which == result_which::ERROR)
         {
-            this->error().~Error();
+            _error.~Error();
         }
-        which = e_which::NONE;
+        which = result_which::NONE;
     }
-public:
-    result() : which(e_which::NONE) {}
+};
+
+// storage, both alternatives trivially destructible: trivial destructor
+template <typename Ok, typename Error>
+struct result_storage<Ok, Error, true>
+{
+    union
+    {
+        char _none;
+        Ok _ok;
+        Error _error;
+    };
+    result_which which;
+
+    constexpr result_storage() : _none(), which(result_which::NONE) {}
+    template <typename... T>
+    constexpr result_storage(_Ok, T &&... params) : _ok(std::forward<T>(params)...), which(result_which::OK) {}
+    template <typename... T>
+    constexpr result_storage(_Error, T &&... params) : _error(std::forward<T>(params)...), which(result_which::ERROR) {}
+
     template <typename... T>
-    result(_Ok, T... params) : which(e_which::OK)
+    void construct_ok(T &&... params)
     {
-        new (buffer) Ok(std::forward<T>(params)...);
+        new (&_ok) Ok(std::forward<T>(params)...);
+        which = result_which::OK;
     }
+
     template <typename... T>
-    result(_Error, T... params) : which(e_which::ERROR)
+    void construct_error(T &&... params)
+    {
+        new (&_error) Error(std::forward<T>(params)...);
+        which = result_which::ERROR;
+    }
+
+    void destroy()
+    {
+        which = result_which::NONE;
+    }
+};
+
+// assignment of one alternative, in place if the storage already holds it
+template <typename Ok, typename Error, typename T>
+void result_assign_ok(result_storage<Ok, Error> &storage, T &&val)
+{
+    if (storage.which == result_which::OK)
+    {
+        storage._ok = std::forward<T>(val);
+    }
+    else
+    {
+        storage.destroy();
+        storage.construct_ok(std::forward<T>(val));
+    }
+}
+
+template <typename Ok, typename Error, typename T>
+void result_assign_error(result_storage<Ok, Error> &storage, T &&val)
+{
+    if (storage.which == result_which::ERROR)
     {
-        new (buffer) Error(std::forward<T>(params)...);
+        storage._error = std::forward<T>(val);
     }
-    result(const result &other)
+    else
     {
-        which = other.which;
-        if (other.is_ok())
+        storage.destroy();
+        storage.construct_error(std::forward<T>(val));
+    }
+}
+
+// copy and move, trivial when both alternatives are trivially copyable
+template <typename Ok, typename Error, bool TriviallyCopyable = std::is_trivially_copyable<Ok>::value && std::is_trivially_copyable<Error>::value>
+struct result_base : result_storage<Ok, Error>
+{
+    using result_storage<Ok, Error>::result_storage;
+};
+
+template <typename Ok, typename Error>
+struct result_base<Ok, Error, false> : result_storage<Ok, Error>
+{
+    using result_storage<Ok, Error>::result_storage;
+
+    result_base() = default;
+    result_base(const result_base &other) : result_storage<Ok, Error>()
+    {
+        if (other.which == result_which::OK)
         {
-            new (buffer) Ok(other.ok());
+            this->construct_ok(other._ok);
         }
-        else if (other.is_error())
+        else if (other.which == result_which::ERROR)
         {
-            new (buffer) Error(other.error());
+            this->construct_error(other._error);
         }
     }
-    result(result &&other)
+    result_base(result_base &&other)
     {
-        which = other.which;
-        if (other.is_ok())
+        if (other.which == result_which::OK)
         {
-            new (buffer) Ok(std::move(other.ok()));
+            this->construct_ok(std::move(other._ok));
         }
-        if (other.is_error())
+        else if (other.which == result_which::ERROR)
         {
-            new (buffer) Error(std::move(other.error()));
+            this->construct_error(std::move(other._error));
         }
     }
-    result & operator =(const result &other)
+    result_base & operator =(const result_base &other)
     {
-        if (other.is_ok())
+        if (other.which == result_which::OK)
         {
-            assign_ok(other.ok());
+            result_assign_ok(*this, other._ok);
         }
-        else if (other.is_error())
+        else if (other.which == result_which::ERROR)
         {
-            assign_error(other.error());
+            result_assign_error(*this, other._error);
         }
         else
         {
-            destroy();
+            this->destroy();
         }
-        
+
         return *this;
     }
-    result & operator =(result &&other)
+    result_base & operator =(result_base &&other)
     {
-        if (other.is_ok())
+        if (other.which == result_which::OK)
         {
-            assign_ok(std::move(other.ok()));
+            result_assign_ok(*this, std::move(other._ok));
         }
-        else if (other.is_error())
+        else if (other.which == result_which::ERROR)
         {
-            assign_error(std::move(other.error()));
+            result_assign_error(*this, std::move(other._error));
         }
         else
         {
-            destroy();
+            this->destroy();
         }
-        
+
         return *this;
     }
-    ~result()
+};
+
+template <typename Ok, typename Error>
+class result : private result_base<Ok, Error>
+{
+    using base = result_base<Ok, Error>;
+public:
+    constexpr result() = default;
+    template <typename... T>
+    constexpr result(_Ok, T &&... params) : base(_Ok(), std::forward<T>(params)...) {}
+    template <typename... T>
+    constexpr result(_Error, T &&... params) : base(_Error(), std::forward<T>(params)...) {}
+
+    template <typename T>
+    Ok &assign_ok(T &&val)
     {
-        destroy();
+        result_assign_ok<Ok, Error>(*this, std::forward<T>(val));
+        return ok();
     }
-    
+
     template <typename T>
-    Ok &assign_ok(T val)
+    Error &assign_error(T &&val)
+    {
+        result_assign_error<Ok, Error>(*this, std::forward<T>(val));
+        return error();
+    }
+
+    constexpr Ok &ok() { mr_assert(is_ok()); return this->_ok; }
+    constexpr Error &error() { mr_assert(is_error()); return this->_error; }
+    constexpr const Ok &ok() const { mr_assert(is_ok()); return this->_ok; }
+    constexpr const Error &error() const { mr_assert(is_error()); return this->_error; }
+    constexpr bool is_ok() const { return this->which == result_which::OK; }
+    constexpr bool is_error() const { return this->which == result_which::ERROR; }
+    constexpr bool is_none() const { return this->which == result_which::NONE; }
+};
+
+
+// monad implementation
+// evaluated eagerly: each step is a single branch on the tag,
+// an error or empty result short-circuits the rest of the chain
+#include "monad.h"
+
+template <typename T, typename E>
+struct monad<result<T, E>>
+{
+    using ElemType = T;
+    template <typename U> using OtherType = result<U, E>;
+    using M = result<T, E>;
+    static const bool has_monad = true;
+    template <typename Func>
+    static constexpr auto fmap(const M &from, Func f)
     {
-        if (is_ok())
+        using To = decltype(f(std::declval<T>()));
+        using RetType = result<To, E>;
+        if (from.is_ok())
         {
-            ok() = std::forward<T>(val);
+            return RetType(Ok, f(from.ok()));
         }
-        else
+        else if (from.is_error())
         {
-            destroy();
-            new (buffer) Ok(std::forward<T>(val));
-            which = e_which::OK;
+            return RetType(Error, from.error());
         }
-        
-        return ok();
+        return RetType();
     }
-    
-    template <typename T>
-    Error &assign_error(T val)
+
+    // the value (or error) of an rvalue result is moved on
+    template <typename Func>
+    static constexpr auto fmap(M &&from, Func f)
     {
-        if (is_error())
+        using To = decltype(f(std::declval<T>()));
+        using RetType = result<To, E>;
+        if (from.is_ok())
         {
-            error() = std::forward<T>(val);
+            return RetType(Ok, f(std::move(from.ok())));
         }
-        else
+        else if (from.is_error())
         {
-            destroy();
-            new (buffer) Error(std::forward<T>(val));
-            which = e_which::ERROR;
+            return RetType(Error, std::move(from.error()));
         }
-        
-        return error();
+        return RetType();
+    }
+
+    static constexpr M join(result<M, E> v)
+    {
+        if (v.is_ok())
+        {
+            return std::move(v.ok());
+        }
+        else if (v.is_error())
+        {
+            return M(Error, std::move(v.error()));
+        }
+        return M();
+    }
+
+    static constexpr M wrap(T e)
+    {
+        return M(Ok, std::move(e));
+    }
+
+    template <typename Func>
+    static constexpr auto bind(const M &p, Func f)
+    {
+        using RetType = decltype(f(std::declval<T>()));
+        if (p.is_ok())
+        {
+            return f(p.ok());
+        }
+        else if (p.is_error())
+        {
+            return RetType(Error, p.error());
+        }
+        return RetType();
+    }
+
+    template <typename Func>
+    static constexpr auto bind(M &&p, Func f)
+    {
+        using RetType = decltype(f(std::declval<T>()));
+        if (p.is_ok())
+        {
+            return f(std::move(p.ok()));
+        }
+        else if (p.is_error())
+        {
+            return RetType(Error, std::move(p.error()));
+        }
+        return RetType();
+    }
+};
+
+// monad apply for result, evaluated eagerly:
+// the first input that is not ok decides the result, same as nested binds,
+// otherwise f is called with references into the inputs
+template <typename E, typename... Ts>
+struct monad_apply_impl<std::tuple<result<Ts, E>...>>
+{
+    using MonadTuple = std::tuple<result<Ts, E>...>;
+
+    template <typename Func>
+    static auto call(const MonadTuple &ms, Func f)
+    {
+        return call(ms, f, std::index_sequence_for<Ts...>());
+    }
+
+private:
+    template <typename Func, size_t... I>
+    static auto call(const MonadTuple &ms, Func &f, std::index_sequence<I...>)
+    {
+        using RetType = result<decltype(f(std::declval<Ts>()...)), E>;
+        const bool is_ok[] = { std::get<I>(ms).is_ok()... };
+        const E *errors[] = { (std::get<I>(ms).is_error() ? &std::get<I>(ms).error() : nullptr)... };
+        for (size_t i = 0; i < sizeof...(Ts); i++)
+        {
+            if (!is_ok[i])
+            {
+                return errors[i] != nullptr ? RetType(Error, *errors[i]) : RetType();
+            }
+        }
+        return RetType(Ok, f(std::get<I>(ms).ok()...));
     }
-    
-    Ok &ok() { mr_assert(is_ok()); return *(Ok *) buffer; }
-    Error &error() { mr_assert(is_error()); return *(Error *) buffer; }
-    const Ok &ok() const { mr_assert(is_ok()); return *(Ok *) buffer; }
-    const Error &error() const { mr_assert(is_error()); return *(Error *) buffer; }
-    bool is_ok() const { return which == e_which::OK; }
-    bool is_error() const { return which == e_which::ERROR; }
-    bool is_none() const { return which == e_which::NONE; }
 };
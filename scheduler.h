@@ -0,0 +1,277 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+
+enum class continuation_priority : int8_t
+{
+    background = -1,
+    normal = 0,
+    interactive = 1,
+};
+
+// priority and optional deadline of a continuation
+// higher priority runs first, then the earlier deadline, then registration order
+struct continuation_tag
+{
+    using clock = std::chrono::steady_clock;
+
+    continuation_priority priority = continuation_priority::normal;
+    clock::time_point deadline = clock::time_point::max();
+
+    continuation_tag() = default;
+    continuation_tag(continuation_priority priority, clock::time_point deadline = clock::time_point::max())
+        : priority(priority), deadline(deadline) {}
+
+    // true if a continuation tagged with this runs before one tagged with other
+    bool before(const continuation_tag &other) const
+    {
+        if (priority != other.priority)
+        {
+            return priority > other.priority;
+        }
+        return deadline < other.deadline;
+    }
+};
+
+// runs the continuations of promises and observables
+//
+// by default a continuation runs synchronously, nested inside the resolve / push
+// that triggered it, so the stack grows with the length of a chain.
+// in trampoline mode, a continuation dispatched while another one is running is
+// queued instead, and the outermost dispatch drains the queue in a loop:
+// stack depth stays flat, continuations run breadth first, and a nested
+// resolve / push returns before its own continuations have run.
+//
+// continuations are tagged with a continuation_tag. callbacks of one promise or
+// observable run in tag order, and the trampoline queue is ordered by tag too.
+// callbacks registered without a tag take the current one: the tag of the
+// continuation running, or the one set by a continuation_tag_scope; so fmap / bind
+// stages built inside a scope, or by a tagged continuation, inherit its tag.
+class continuation_scheduler
+{
+    struct entry
+    {
+        continuation_tag tag;
+        uint64_t sequence;
+        std::function<void()> f;
+        // or run(owner), which needs no allocation beyond the owner's
+        std::shared_ptr<void> owner;
+        void (*run)(void *);
+
+        void operator () ()
+        {
+            if (run != nullptr)
+            {
+                run(owner.get());
+            }
+            else
+            {
+                f();
+            }
+        }
+
+        // heap order, the top runs first
+        bool operator < (const entry &other) const
+        {
+            if (tag.before(other.tag))
+            {
+                return false;
+            }
+            if (other.tag.before(tag))
+            {
+                return true;
+            }
+            return sequence > other.sequence;
+        }
+    };
+
+    // entries with the default tag, the common case, skip the heap
+    // a vector consumed from fifo_head, so its storage is reused from one drain to the next
+    std::vector<entry> fifo;
+    size_t fifo_head = 0;
+    std::vector<entry> heap;
+    uint64_t sequence = 0;
+    bool draining = false;
+    bool trampoline = false;
+    continuation_tag current_tag;
+
+    static bool is_default(const continuation_tag &tag)
+    {
+        return !tag.before(continuation_tag()) && !continuation_tag().before(tag);
+    }
+
+    void enqueue(entry e)
+    {
+        if (is_default(e.tag))
+        {
+            fifo.push_back(std::move(e));
+        }
+        else
+        {
+            heap.push_back(std::move(e));
+            std::push_heap(heap.begin(), heap.end());
+        }
+    }
+
+    // the heap top goes first only if it is tagged to run before the default
+    bool dequeue(entry &e)
+    {
+        bool fifo_empty = fifo_head == fifo.size();
+        if (!heap.empty() && (fifo_empty || heap.front().tag.before(fifo[fifo_head].tag)))
+        {
+            std::pop_heap(heap.begin(), heap.end());
+            e = std::move(heap.back());
+            heap.pop_back();
+            return true;
+        }
+        if (!fifo_empty)
+        {
+            e = std::move(fifo[fifo_head++]);
+            if (fifo_head == fifo.size())
+            {
+                fifo.clear();
+                fifo_head = 0;
+            }
+            else if (fifo_head >= 64 && fifo_head * 2 >= fifo.size())
+            {
+                // never emptied, drop what has run
+                fifo.erase(fifo.begin(), fifo.begin() + fifo_head);
+                fifo_head = 0;
+            }
+            return true;
+        }
+        return false;
+    }
+
+    template <typename Run>
+    void drain(const continuation_tag &tag, Run &&first)
+    {
+        drain_guard guard(*this);
+        run_tagged(tag, first);
+        while (true)
+        {
+            entry next;
+            if (!dequeue(next))
+            {
+                break;
+            }
+            run_tagged(next.tag, next);
+        }
+    }
+
+    struct drain_guard
+    {
+        continuation_scheduler &scheduler;
+        drain_guard(continuation_scheduler &scheduler) : scheduler(scheduler) { scheduler.draining = true; }
+        ~drain_guard()
+        {
+            // if a continuation threw, the rest stay queued (see dispatch)
+            scheduler.draining = false;
+        }
+    };
+
+public:
+    static continuation_scheduler &get()
+    {
+        static thread_local continuation_scheduler instance;
+        return instance;
+    }
+
+    void set_trampoline(bool enabled) { trampoline = enabled; }
+    bool is_trampoline() const { return trampoline; }
+
+    // true if a continuation dispatched now would be queued rather than run
+    bool is_deferring() const { return trampoline && draining; }
+
+    // continuations left queued by one that threw
+    bool has_pending() const { return !draining && (fifo_head < fifo.size() || !heap.empty()); }
+
+    void run_pending()
+    {
+        if (has_pending())
+        {
+            drain(current_tag, []() {});
+        }
+    }
+
+    const continuation_tag &current() const { return current_tag; }
+    void set_current(const continuation_tag &tag) { current_tag = tag; }
+
+    // runs f with `tag` as the current tag
+    template <typename Func>
+    void run_tagged(const continuation_tag &tag, Func &&f)
+    {
+        struct restore
+        {
+            continuation_tag &current;
+            continuation_tag saved;
+            ~restore() { current = saved; }
+        } guard { current_tag, current_tag };
+        current_tag = tag;
+        f();
+    }
+
+    // if a continuation throws, the exception leaves the outermost dispatch and the
+    // continuations still queued are kept, not dropped: the next outermost dispatch
+    // runs them after its own, or run_pending() runs them right away.
+    template <typename Func>
+    void dispatch(Func f)
+    {
+        dispatch(std::move(f), current_tag);
+    }
+
+    template <typename Func>
+    void dispatch(Func f, const continuation_tag &tag)
+    {
+        if (!trampoline)
+        {
+            f();
+        }
+        else if (draining)
+        {
+            enqueue(entry { tag, sequence++, std::move(f), nullptr, nullptr });
+        }
+        else
+        {
+            drain(tag, f);
+        }
+    }
+
+    // dispatch(run(owner)), keeping owner alive until it has run
+    void dispatch_call(std::shared_ptr<void> owner, void (*run)(void *), const continuation_tag &tag)
+    {
+        if (!trampoline)
+        {
+            run(owner.get());
+        }
+        else if (draining)
+        {
+            enqueue(entry { tag, sequence++, nullptr, std::move(owner), run });
+        }
+        else
+        {
+            drain(tag, [&owner, run]() { run(owner.get()); });
+        }
+    }
+};
+
+// sets the current continuation tag for this scope
+class continuation_tag_scope
+{
+    continuation_tag saved;
+public:
+    continuation_tag_scope(const continuation_tag &tag) : saved(continuation_scheduler::get().current())
+    {
+        continuation_scheduler::get().set_current(tag);
+    }
+    ~continuation_tag_scope()
+    {
+        continuation_scheduler::get().set_current(saved);
+    }
+};
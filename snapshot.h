@@ -0,0 +1,420 @@
+#pragma once
+
+// snapshots of observable values, for warm restarts
+// register the observables to keep under stable names, save() their current values
+// into a compact binary blob, and after a restart, once the graph is built again,
+// restore() them all: derived nodes get their saved values directly instead of being
+// recomputed by replaying inputs through the graph, and no observer is notified.
+// a file snapshot is read straight out of a read only mapping.
+//
+// layout (native byte order, for the same build on the same architecture):
+//   magic, version, entry count,
+//   per entry: name, type fingerprint, payload size, payload
+//
+// trivially copyable values are saved as their bytes. a pointer would not survive a
+// restart, so pointers are rejected, and structs holding pointers (or handles of any
+// kind) must specialize snapshot_codec to save what they point to.
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <type_traits>
+#include <typeinfo>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "mmap_stream.h"
+#include "observable.h"
+#include "result.h"
+
+// how a T is written into a snapshot; trivially copyable types are copied as bytes,
+// other types need a specialization
+template <typename T, typename Enable = void>
+struct snapshot_codec
+{
+    static_assert(std::is_trivially_copyable<T>::value, "specialize snapshot_codec for this type");
+    static_assert(!std::is_pointer<T>::value, "a pointer is not valid after a restart");
+
+    static void write(std::string &out, const T &value)
+    {
+        out.append(reinterpret_cast<const char *>(&value), sizeof(T));
+    }
+
+    static bool read(const char *&p, const char *end, T &value)
+    {
+        if (size_t(end - p) < sizeof(T))
+        {
+            return false;
+        }
+        memcpy(&value, p, sizeof(T));
+        p += sizeof(T);
+        return true;
+    }
+};
+
+template <>
+struct snapshot_codec<std::string>
+{
+    static void write(std::string &out, const std::string &value)
+    {
+        snapshot_codec<uint64_t>::write(out, value.size());
+        out.append(value);
+    }
+
+    static bool read(const char *&p, const char *end, std::string &value)
+    {
+        uint64_t size;
+        if (!snapshot_codec<uint64_t>::read(p, end, size) || uint64_t(end - p) < size)
+        {
+            return false;
+        }
+        value.assign(p, size_t(size));
+        p += size;
+        return true;
+    }
+};
+
+template <typename E, typename A>
+struct snapshot_codec<std::vector<E, A>>
+{
+    static void write(std::string &out, const std::vector<E, A> &value)
+    {
+        snapshot_codec<uint64_t>::write(out, value.size());
+        write(out, value, block());
+    }
+
+    static bool read(const char *&p, const char *end, std::vector<E, A> &value)
+    {
+        uint64_t size;
+        if (!snapshot_codec<uint64_t>::read(p, end, size))
+        {
+            return false;
+        }
+        return read(p, end, size, value, block());
+    }
+
+private:
+    // trivially copyable elements go in one block, except bits of a std::vector<bool>
+    using block = std::integral_constant<bool, std::is_trivially_copyable<E>::value && !std::is_same<E, bool>::value>;
+
+    static void write(std::string &out, const std::vector<E, A> &value, std::true_type)
+    {
+        out.append(reinterpret_cast<const char *>(value.data()), value.size() * sizeof(E));
+    }
+
+    static void write(std::string &out, const std::vector<E, A> &value, std::false_type)
+    {
+        for (const auto &item : value)
+        {
+            snapshot_codec<E>::write(out, item);
+        }
+    }
+
+    static bool read(const char *&p, const char *end, uint64_t size, std::vector<E, A> &value, std::true_type)
+    {
+        if (uint64_t(end - p) / sizeof(E) < size)
+        {
+            return false;
+        }
+        value.resize(size_t(size));
+        memcpy(value.data(), p, size_t(size) * sizeof(E));
+        p += size * sizeof(E);
+        return true;
+    }
+
+    static bool read(const char *&p, const char *end, uint64_t size, std::vector<E, A> &value, std::false_type)
+    {
+        value.clear();
+        for (uint64_t i = 0; i < size; i++)
+        {
+            E item;
+            if (!snapshot_codec<E>::read(p, end, item))
+            {
+                return false;
+            }
+            value.push_back(std::move(item));
+        }
+        return true;
+    }
+};
+
+template <typename A, typename B>
+struct snapshot_codec<std::pair<A, B>>
+{
+    static void write(std::string &out, const std::pair<A, B> &value)
+    {
+        snapshot_codec<A>::write(out, value.first);
+        snapshot_codec<B>::write(out, value.second);
+    }
+
+    static bool read(const char *&p, const char *end, std::pair<A, B> &value)
+    {
+        return snapshot_codec<A>::read(p, end, value.first) && snapshot_codec<B>::read(p, end, value.second);
+    }
+};
+
+template <typename K, typename V, typename C, typename A>
+struct snapshot_codec<std::map<K, V, C, A>>
+{
+    static void write(std::string &out, const std::map<K, V, C, A> &value)
+    {
+        snapshot_codec<uint64_t>::write(out, value.size());
+        for (auto &item : value)
+        {
+            snapshot_codec<K>::write(out, item.first);
+            snapshot_codec<V>::write(out, item.second);
+        }
+    }
+
+    static bool read(const char *&p, const char *end, std::map<K, V, C, A> &value)
+    {
+        uint64_t size;
+        if (!snapshot_codec<uint64_t>::read(p, end, size))
+        {
+            return false;
+        }
+        value.clear();
+        for (uint64_t i = 0; i < size; i++)
+        {
+            K key;
+            V item;
+            if (!snapshot_codec<K>::read(p, end, key) || !snapshot_codec<V>::read(p, end, item))
+            {
+                return false;
+            }
+            value.emplace_hint(value.end(), std::move(key), std::move(item));
+        }
+        return true;
+    }
+};
+
+struct snapshot_error
+{
+    enum class kind { io, bad_format, type_mismatch };
+
+    kind code;
+    std::string name; // the entry if any, or the file on io
+    int err = 0; // errno on io
+
+    std::string message() const
+    {
+        switch (code)
+        {
+            case kind::io: return name + ": " + strerror(err);
+            case kind::bad_format: return "bad snapshot format" + (name.empty() ? "" : " at " + name);
+            case kind::type_mismatch: return "type mismatch for " + name;
+        }
+        return "";
+    }
+};
+
+class observable_snapshot
+{
+    enum : uint32_t
+    {
+        magic = 0x504e534d, // "MSNP"
+        version = 1,
+    };
+
+    struct entry
+    {
+        uint64_t fingerprint;
+        std::function<bool(std::string &)> save; // false if the observable is gone
+        // decodes, and returns what applies the value
+        std::function<bool(const char *, const char *, std::function<void()> &)> load;
+    };
+
+    std::map<std::string, entry> entries; // by name, so equal state saves to equal bytes
+
+    // stable for a given build, which is what a snapshot is restored into
+    template <typename T>
+    static uint64_t fingerprint()
+    {
+        uint64_t hash = 14695981039346656037ull;
+        for (const char *c = typeid(T).name(); *c; c++)
+        {
+            hash = (hash ^ uint8_t(*c)) * 1099511628211ull;
+        }
+        return hash ^ sizeof(T);
+    }
+
+    static result<size_t, snapshot_error> bad_format(std::string name = "")
+    {
+        return result<size_t, snapshot_error>(Error, snapshot_error { snapshot_error::kind::bad_format, std::move(name) });
+    }
+
+public:
+    // held weakly; an observable gone by save() time is left out
+    template <typename T>
+    void add(const std::string &name, const observable_ptr<T> &o)
+    {
+        observable_weak_ptr<T> weak(o);
+        entries[name] = entry {
+            fingerprint<T>(),
+            [weak](std::string &out) {
+                auto o = weak.lock();
+                if (!o)
+                {
+                    return false;
+                }
+                snapshot_codec<T>::write(out, o->get());
+                return true;
+            },
+            [weak](const char *p, const char *end, std::function<void()> &apply) {
+                auto value = std::make_shared<T>();
+                if (!snapshot_codec<T>::read(p, end, *value) || p != end)
+                {
+                    return false;
+                }
+                apply = [weak, value]() {
+                    auto o = weak.lock();
+                    if (o)
+                    {
+                        o->restore(std::move(*value));
+                    }
+                };
+                return true;
+            },
+        };
+    }
+
+    size_t size() const
+    {
+        return entries.size();
+    }
+
+    std::string save() const
+    {
+        std::string out;
+        snapshot_codec<uint32_t>::write(out, uint32_t(magic));
+        snapshot_codec<uint32_t>::write(out, uint32_t(version));
+        size_t count_at = out.size();
+        snapshot_codec<uint32_t>::write(out, 0);
+
+        uint32_t count = 0;
+        std::string payload;
+        for (auto &it : entries)
+        {
+            payload.clear();
+            if (!it.second.save(payload))
+            {
+                continue;
+            }
+            snapshot_codec<std::string>::write(out, it.first);
+            snapshot_codec<uint64_t>::write(out, it.second.fingerprint);
+            snapshot_codec<std::string>::write(out, payload);
+            count++;
+        }
+        memcpy(&out[count_at], &count, sizeof(count));
+        return out;
+    }
+
+    // sets every registered observable found in the snapshot, or none if the snapshot
+    // does not decode; observers are not notified. returns how many were restored.
+    result<size_t, snapshot_error> restore(const char *data, size_t size) const
+    {
+        const char *p = data;
+        const char *end = data + size;
+        uint32_t file_magic, file_version, count;
+        if (!snapshot_codec<uint32_t>::read(p, end, file_magic) || !snapshot_codec<uint32_t>::read(p, end, file_version)
+            || !snapshot_codec<uint32_t>::read(p, end, count) || file_magic != magic || file_version != version)
+        {
+            return bad_format();
+        }
+
+        std::vector<std::function<void()>> applies;
+        for (uint32_t i = 0; i < count; i++)
+        {
+            std::string name;
+            uint64_t file_fingerprint, payload_size;
+            if (!snapshot_codec<std::string>::read(p, end, name) || !snapshot_codec<uint64_t>::read(p, end, file_fingerprint)
+                || !snapshot_codec<uint64_t>::read(p, end, payload_size) || uint64_t(end - p) < payload_size)
+            {
+                return bad_format(name);
+            }
+            const char *payload = p;
+            p += payload_size;
+
+            auto it = entries.find(name);
+            if (it == entries.end())
+            {
+                continue; // no longer registered
+            }
+            if (it->second.fingerprint != file_fingerprint)
+            {
+                return result<size_t, snapshot_error>(Error, snapshot_error { snapshot_error::kind::type_mismatch, name });
+            }
+            std::function<void()> apply;
+            if (!it->second.load(payload, p, apply))
+            {
+                return bad_format(name);
+            }
+            applies.push_back(std::move(apply));
+        }
+
+        for (auto &apply : applies)
+        {
+            apply();
+        }
+        return result<size_t, snapshot_error>(Ok, applies.size());
+    }
+
+    // written to a temporary file first and renamed, so a crash never leaves a torn snapshot
+    result<size_t, snapshot_error> save_file(const std::string &path) const
+    {
+        std::string data = save();
+        std::string tmp_path = path + ".tmp";
+        int fd = ::open(tmp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0)
+        {
+            return result<size_t, snapshot_error>(Error, snapshot_error { snapshot_error::kind::io, path, errno });
+        }
+        size_t written = 0;
+        while (written < data.size())
+        {
+            ssize_t n = ::write(fd, data.data() + written, data.size() - written);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n < 0)
+            {
+                int code = errno;
+                close(fd);
+                unlink(tmp_path.c_str());
+                return result<size_t, snapshot_error>(Error, snapshot_error { snapshot_error::kind::io, path, code });
+            }
+            written += size_t(n);
+        }
+        bool synced = fsync(fd) == 0;
+        int code = errno;
+        bool closed = close(fd) == 0;
+        if (closed && !synced)
+        {
+            errno = code;
+        }
+        if (!synced || !closed || rename(tmp_path.c_str(), path.c_str()) < 0)
+        {
+            code = errno;
+            unlink(tmp_path.c_str());
+            return result<size_t, snapshot_error>(Error, snapshot_error { snapshot_error::kind::io, path, code });
+        }
+        return result<size_t, snapshot_error>(Ok, data.size());
+    }
+
+    result<size_t, snapshot_error> restore_file(const std::string &path) const
+    {
+        auto file = mapped_file::open(path);
+        if (!file.is_ok())
+        {
+            return result<size_t, snapshot_error>(Error, snapshot_error { snapshot_error::kind::io, path, file.error().code });
+        }
+        return restore(file.ok()->data(), file.ok()->size());
+    }
+};
@@ -0,0 +1,498 @@
+#pragma once
+
+// pull based asynchronous streams, processed a chunk at a time
+// the consumer pulls up to n items and gets a promise of a chunk; stages transform
+// whole chunks, so the per element cost is a plain loop rather than a callback.
+// a chunk may be empty, the stream ends with the chunk marked last.
+// a stream has a single consumer, which pulls again only once the previous pull resolved;
+// a pulled chunk belongs to the consumer, which may move its items out.
+
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "promise.h"
+
+template <typename T>
+struct stream_chunk
+{
+    std::vector<T> items;
+    bool last = false;
+};
+
+template <typename T>
+class stream
+{
+public:
+    using chunk = stream_chunk<T>;
+    using puller = std::function<promise_ptr<chunk>(size_t)>;
+
+private:
+    puller source;
+
+    stream(puller source) : source(std::move(source)) {}
+
+    DISALLOW_COPY_AND_ASSIGN(stream);
+public:
+    using ResultType = T;
+    static const size_t default_chunk_size = 1024;
+
+    // up to max_items items
+    promise_ptr<chunk> pull(size_t max_items = default_chunk_size)
+    {
+        return source(max_items);
+    }
+
+    static std::shared_ptr<stream> create(puller source)
+    {
+        return std::shared_ptr<stream>(new stream(std::move(source)));
+    }
+
+    // moves the items out in chunks of at most chunk_size
+    static std::shared_ptr<stream> from_vector(std::vector<T> items, size_t chunk_size = default_chunk_size)
+    {
+        auto state = std::make_shared<std::pair<std::vector<T>, size_t>>(std::move(items), 0);
+        return create([state, chunk_size](size_t max_items) {
+            auto &items = state->first;
+            size_t &position = state->second;
+            size_t count = std::min(std::min(max_items, chunk_size), items.size() - position);
+            chunk c;
+            c.items.reserve(count);
+            std::move(items.begin() + position, items.begin() + position + count, std::back_inserter(c.items));
+            position += count;
+            c.last = position == items.size();
+            return promise<chunk>::create(std::move(c));
+        });
+    }
+};
+
+template <typename T>
+using stream_ptr = std::shared_ptr<stream<T>>;
+
+// pulls until `on_chunk` returns false or the stream ends, then resolves `done`;
+// synchronously available chunks are handled in a loop, without recursion
+template <typename T, typename Func>
+void stream_drain(stream_ptr<T> s, size_t chunk_size, Func on_chunk, std::function<void()> done)
+{
+    using chunk = stream_chunk<T>;
+    struct state : std::enable_shared_from_this<state>
+    {
+        stream_ptr<T> s;
+        size_t chunk_size;
+        Func on_chunk;
+        std::function<void()> done;
+
+        state(stream_ptr<T> s, size_t chunk_size, Func on_chunk, std::function<void()> done)
+            : s(std::move(s)), chunk_size(chunk_size), on_chunk(std::move(on_chunk)), done(std::move(done)) {}
+
+        // false if the chunk ends the drain
+        bool handle(chunk &c)
+        {
+            bool last = c.last;
+            if (!on_chunk(c) || last)
+            {
+                done();
+                return false;
+            }
+            return true;
+        }
+
+        void run()
+        {
+            while (true)
+            {
+                auto p = s->pull(chunk_size);
+                if (!p->is_finished())
+                {
+                    auto self = this->shared_from_this();
+                    promise<chunk> *raw = p.get();
+                    // p holds itself through the callback until it fires
+                    p->then([self, raw, p](const chunk &) {
+                        if (self->handle(raw->result()))
+                        {
+                            self->run();
+                        }
+                    });
+                    return;
+                }
+                if (!handle(p->result()))
+                {
+                    return;
+                }
+            }
+        }
+    };
+    std::make_shared<state>(std::move(s), chunk_size, std::move(on_chunk), std::move(done))->run();
+}
+
+// every item of the stream
+template <typename T>
+promise_ptr<std::vector<T>> stream_collect(stream_ptr<T> s, size_t chunk_size = stream<T>::default_chunk_size)
+{
+    auto ret_promise = promise<std::vector<T>>::create();
+    auto items = std::make_shared<std::vector<T>>();
+    stream_drain(std::move(s), chunk_size, [items](stream_chunk<T> &c) {
+        if (items->empty())
+        {
+            *items = std::move(c.items);
+        }
+        else
+        {
+            std::move(c.items.begin(), c.items.end(), std::back_inserter(*items));
+        }
+        return true;
+    }, [ret_promise, items]() {
+        ret_promise->resolve(std::move(*items));
+    });
+    return ret_promise;
+}
+
+// calls f with each chunk's items, resolves with the number of items
+template <typename T, typename Func>
+promise_ptr<size_t> stream_for_each_chunk(stream_ptr<T> s, Func f, size_t chunk_size = stream<T>::default_chunk_size)
+{
+    auto ret_promise = promise<size_t>::create();
+    auto count = std::make_shared<size_t>(0);
+    stream_drain(std::move(s), chunk_size, [f = std::move(f), count](stream_chunk<T> &c) mutable {
+        *count += c.items.size();
+        f(c.items);
+        return true;
+    }, [ret_promise, count]() {
+        ret_promise->resolve(*count);
+    });
+    return ret_promise;
+}
+
+// batch aware stage: f takes a chunk's items (std::vector<T> &&) and returns the new items
+template <typename T, typename Func>
+auto stream_map_chunks(stream_ptr<T> from, Func f)
+{
+    using To = typename decltype(f(std::declval<std::vector<T>>()))::value_type;
+    using chunk = stream_chunk<T>;
+    auto shared_f = std::make_shared<Func>(std::move(f));
+    return stream<To>::create([from, shared_f](size_t max_items) {
+        auto p = from->pull(max_items);
+        promise<chunk> *raw = p.get();
+        return monad<promise_ptr<chunk>>::fmap(std::move(p), [raw, shared_f](const chunk &) {
+            chunk &c = raw->result();
+            stream_chunk<To> out;
+            out.items = (*shared_f)(std::move(c.items));
+            out.last = c.last;
+            return out;
+        });
+    });
+}
+
+template <typename T, typename Pred>
+stream_ptr<T> stream_filter(stream_ptr<T> from, Pred pred)
+{
+    return stream_map_chunks(std::move(from), [pred = std::move(pred)](std::vector<T> &&items) mutable {
+        items.erase(std::remove_if(items.begin(), items.end(), [&pred](const T &item) { return !pred(item); }), items.end());
+        return std::move(items);
+    });
+}
+
+
+// monad implementation
+#include "monad.h"
+
+// bind concatenates: every item of the stream returned for the first item,
+// then for the second, and so on. a stream is consumed once, so f returns a new one each call
+template <typename T>
+struct monad<stream_ptr<T>>
+{
+    using ElemType = T;
+    template <typename U> using OtherType = stream_ptr<U>;
+    using M = stream_ptr<T>;
+    using chunk = stream_chunk<T>;
+    static const bool has_monad = true;
+
+    template <typename Func>
+    static auto fmap(M from, Func f)
+    {
+        using To = decltype(f(std::declval<T>()));
+        return stream_map_chunks(std::move(from), [f = std::move(f)](std::vector<T> &&items) mutable {
+            std::vector<To> out;
+            out.reserve(items.size());
+            for (auto &item : items)
+            {
+                out.push_back(f(std::move(item)));
+            }
+            return out;
+        });
+    }
+
+    // fills each pulled chunk from as many inner streams as it takes
+    static M join(stream_ptr<M> from)
+    {
+        struct state : std::enable_shared_from_this<state>
+        {
+            stream_ptr<M> outer;
+            bool outer_done = false;
+            std::deque<M> pending;
+            M current;
+
+            // the pull in progress
+            promise_ptr<chunk> ret_promise;
+            size_t max_items = 0;
+            chunk filling;
+            std::shared_ptr<void> in_flight; // the upstream pull waited for
+
+            bool done() const
+            {
+                return outer_done && pending.empty() && current == nullptr;
+            }
+
+            void take_inner(chunk &c)
+            {
+                if (filling.items.empty())
+                {
+                    filling.items = std::move(c.items);
+                }
+                else
+                {
+                    std::move(c.items.begin(), c.items.end(), std::back_inserter(filling.items));
+                }
+                if (c.last)
+                {
+                    current = nullptr;
+                }
+            }
+
+            void take_outer(stream_chunk<M> &c)
+            {
+                std::move(c.items.begin(), c.items.end(), std::back_inserter(pending));
+                outer_done = c.last;
+            }
+
+            void resolve()
+            {
+                chunk out = std::move(filling);
+                filling = chunk();
+                out.last = done();
+                auto ret = std::move(ret_promise);
+                ret->resolve(std::move(out));
+            }
+
+            // takes chunks while they are available synchronously; the pull resolves once it
+            // is full, or with what it has when an upstream chunk must be waited for, which
+            // is then kept for the next pull
+            void run()
+            {
+                while (in_flight == nullptr)
+                {
+                    if (filling.items.size() >= max_items || done())
+                    {
+                        resolve();
+                        return;
+                    }
+                    if (current == nullptr && !pending.empty())
+                    {
+                        current = std::move(pending.front());
+                        pending.pop_front();
+                    }
+                    if (current != nullptr)
+                    {
+                        auto p = current->pull(max_items - filling.items.size());
+                        if (p->is_finished())
+                        {
+                            take_inner(p->result());
+                            continue;
+                        }
+                        auto self = this->shared_from_this();
+                        promise<chunk> *raw = p.get();
+                        p->then([self, raw](const chunk &) {
+                            self->take_inner(raw->result());
+                            self->resume();
+                        });
+                        in_flight = std::move(p); // until it fires
+                    }
+                    else
+                    {
+                        auto p = outer->pull(max_items);
+                        if (p->is_finished())
+                        {
+                            take_outer(p->result());
+                            continue;
+                        }
+                        auto self = this->shared_from_this();
+                        promise<stream_chunk<M>> *raw = p.get();
+                        p->then([self, raw](const stream_chunk<M> &) {
+                            self->take_outer(raw->result());
+                            self->resume();
+                        });
+                        in_flight = std::move(p); // until it fires
+                    }
+                    if (!filling.items.empty())
+                    {
+                        resolve();
+                    }
+                }
+            }
+
+            // an upstream chunk waited for came in
+            void resume()
+            {
+                in_flight = nullptr;
+                if (ret_promise != nullptr)
+                {
+                    run();
+                }
+            }
+        };
+
+        auto s = std::make_shared<state>();
+        s->outer = std::move(from);
+        return stream<T>::create([s](size_t max_items) {
+            auto ret_promise = promise<chunk>::create();
+            s->ret_promise = ret_promise;
+            s->max_items = std::max<size_t>(max_items, 1);
+            s->run();
+            return ret_promise;
+        });
+    }
+
+    static M wrap(T obj)
+    {
+        std::vector<T> items;
+        items.push_back(std::move(obj));
+        return stream<T>::from_vector(std::move(items));
+    }
+
+    template <typename Func>
+    static auto bind(M p, Func f)
+    {
+        using RetType = decltype(f(std::declval<T>()));
+        return monad<RetType>::join(fmap(std::move(p), std::move(f)));
+    }
+};
+
+// a stream is consumed once, so the sequence of streams zips them rather than
+// taking their product: the n-th vector holds the n-th item of every stream,
+// and the result ends with the shortest stream
+template <typename T>
+stream_ptr<std::vector<T>> monad_sequence(std::vector<stream_ptr<T>> streams)
+{
+    using chunk = stream_chunk<std::vector<T>>;
+    if (streams.empty())
+    {
+        return monad<stream_ptr<std::vector<T>>>::wrap(std::vector<T>());
+    }
+
+    struct state : std::enable_shared_from_this<state>
+    {
+        std::vector<stream_ptr<T>> streams;
+        std::vector<std::deque<T>> buffers;
+        std::vector<bool> done;
+        size_t waiting = 0;
+
+        // the shortest stream ran out
+        bool exhausted() const
+        {
+            for (size_t i = 0; i < streams.size(); i++)
+            {
+                if (done[i] && buffers[i].empty())
+                {
+                    return true;
+                }
+            }
+            return false;
+        }
+
+        // the pull in progress
+        promise_ptr<chunk> ret_promise;
+        size_t max_items = 0;
+
+        // pulls every stream that has nothing buffered, until something lines up;
+        // synchronously available chunks are taken in a loop
+        void run()
+        {
+            while (true)
+            {
+                waiting = 1;
+                for (size_t i = 0; i < streams.size(); i++)
+                {
+                    if (!buffers[i].empty() || done[i])
+                    {
+                        continue;
+                    }
+                    auto p = streams[i]->pull(max_items);
+                    if (p->is_finished())
+                    {
+                        take(i, p->result());
+                        continue;
+                    }
+                    waiting++;
+                    auto self = this->shared_from_this();
+                    promise<stream_chunk<T>> *raw = p.get();
+                    p->then([self, raw, i](const stream_chunk<T> &) {
+                        self->take(i, raw->result());
+                        self->arrived();
+                    });
+                    ret_promise->hold_promise(std::move(p));
+                }
+                if (--waiting > 0 || emit())
+                {
+                    return;
+                }
+            }
+        }
+
+        void take(size_t i, stream_chunk<T> &c)
+        {
+            std::move(c.items.begin(), c.items.end(), std::back_inserter(buffers[i]));
+            done[i] = c.last;
+        }
+
+        void arrived()
+        {
+            if (--waiting == 0 && !emit())
+            {
+                run();
+            }
+        }
+
+        // false if nothing lines up yet, only empty chunks came in
+        bool emit()
+        {
+            size_t count = max_items;
+            for (auto &buffer : buffers)
+            {
+                count = std::min(count, buffer.size());
+            }
+            if (count == 0 && !exhausted())
+            {
+                return false;
+            }
+            chunk out;
+            out.items.resize(count);
+            for (auto &buffer : buffers)
+            {
+                for (size_t n = 0; n < count; n++)
+                {
+                    out.items[n].push_back(std::move(buffer.front()));
+                    buffer.pop_front();
+                }
+            }
+            out.last = exhausted();
+            auto ret = std::move(ret_promise);
+            ret->resolve(std::move(out));
+            return true;
+        }
+    };
+
+    auto s = std::make_shared<state>();
+    s->buffers.resize(streams.size());
+    s->done.resize(streams.size(), false);
+    s->streams = std::move(streams);
+    return stream<std::vector<T>>::create([s](size_t max_items) {
+        auto ret_promise = promise<chunk>::create();
+        s->ret_promise = ret_promise;
+        s->max_items = std::max<size_t>(max_items, 1);
+        s->run();
+        return ret_promise;
+    });
+}
@@ -5,12 +5,24 @@
 
 #include <stdio.h>
 #include <iostream>
+#include <sstream>
+#include <thread>
 
 #include "promise.h"
 #include "maybe.h"
 #include "monad_impl.h"
 
 #include "observable.h"
+#include "event_loop.h"
+#include "file_io.h"
+#include "mmap_stream.h"
+#include "deadline.h"
+#include "channel.h"
+#include "stream.h"
+#include "observable_collection.h"
+#include "memoize.h"
+#include "observable_graph.h"
+#include "snapshot.h"
 
 namespace std {
     std::string to_string(const std::string &f)
@@ -19,6 +31,25 @@ namespace std {
     }
 }
 
+enum class test_state : int { invalid = -1, idle, running };
+template <> struct maybe_niche<test_state> : maybe_sentinel_niche<test_state, test_state::invalid> {};
+
+// counts deep copies and moves of a large payload
+struct counted
+{
+    static int copies;
+    static int moves;
+    std::string payload;
+
+    counted(std::string payload) : payload(std::move(payload)) {}
+    counted(const counted &other) : payload(other.payload) { copies++; }
+    counted(counted &&other) noexcept : payload(std::move(other.payload)) { moves++; }
+    counted &operator =(const counted &other) { payload = other.payload; copies++; return *this; }
+    counted &operator =(counted &&other) noexcept { payload = std::move(other.payload); moves++; return *this; }
+};
+int counted::copies = 0;
+int counted::moves = 0;
+
 int main()
 {
     // test observable join
@@ -188,6 +219,897 @@ int main()
             std::cout << "no result" << std::endl;
         }
     }
+
+    // test maybe monad apply without copies
+    if (true) {
+        maybe<std::unique_ptr<int>> a(new int(6));
+        maybe<int> b(7);
+        auto result = monad_apply(std::make_tuple(std::move(a), b), [](const std::unique_ptr<int> &a, int b) {
+            return *a * b;
+        });
+        auto none = monad_apply(std::make_tuple(maybe<int>(), b), [](int a, int b) {
+            std::cout << "unreachable!" << std::endl;
+            return a * b;
+        });
+        std::cout << result.get() << ", " << none.has_data() << std::endl;
+    }
+    // test maybe layout
+    if (true) {
+        struct alignas(32) wide { float v[8]; };
+        std::cout << sizeof(maybe<int>) << ", " << sizeof(maybe<double>) << ", " << alignof(maybe<wide>) << std::endl;
+        std::cout << (sizeof(maybe<int *>) == sizeof(int *)) << (sizeof(maybe<test_state>) == sizeof(test_state))
+            << std::is_trivially_copyable<maybe<int>>::value << std::is_trivially_destructible<maybe<int>>::value
+            << std::is_trivially_copyable<maybe<std::string>>::value << std::endl;
+
+        int x = 7;
+        maybe<int *> p;
+        maybe<int *> q(&x);
+        maybe<test_state> s(test_state::running);
+        maybe<test_state> none_s(test_state::invalid);
+        std::cout << p.has_data() << q.has_data() << *q.get() << s.has_data() << none_s.has_data() << std::endl;
+        p = q;
+        q.initialize(nullptr);
+        std::cout << p.has_data() << *p.get() << q.has_data() << (q.get() == nullptr) << std::endl;
+
+        constexpr maybe<int> c(42);
+        static_assert(c.has_data() && c.get() == 42, "constexpr maybe");
+    }
+
+    // test result layout
+    if (true) {
+        using R = result<int, test_state>;
+        std::cout << sizeof(R) << ", " << alignof(result<double, char>) << ", " << sizeof(result<double, char>) << std::endl;
+        std::cout << std::is_trivially_copyable<R>::value << std::is_trivially_destructible<R>::value
+            << std::is_trivially_copyable<result<int, std::string>>::value << std::endl;
+
+        constexpr R ok(Ok, 42);
+        constexpr R err(Error, test_state::idle);
+        static_assert(ok.is_ok() && ok.ok() == 42 && err.is_error() && !R().is_ok(), "constexpr result");
+
+        result<std::string, int> r(Ok, "abc");
+        auto r2 = r;
+        r.assign_error(3);
+        std::cout << r.is_error() << r.error() << r2.is_ok() << r2.ok() << std::endl;
+    }
+
+    // test result monad
+    if (true) {
+        using R = result<int, std::string>;
+        auto parse = [](const std::string &s) {
+            return s.empty() ? R(Error, "empty") : R(Ok, atoi(s.c_str()));
+        };
+        auto positive = [](int x) {
+            return x > 0 ? R(Ok, x) : R(Error, "not positive");
+        };
+        auto print = [](const R &r) {
+            if (r.is_ok()) {
+                std::cout << "ok " << r.ok() << std::endl;
+            } else {
+                std::cout << "error " << r.error() << std::endl;
+            }
+        };
+        print((parse("21") >= positive) > [](int x) { return x * 2; });
+        print((parse("-1") >= positive) > [](int x) { return x * 2; });
+        print(parse("") >= positive);
+
+        print(std::make_tuple(parse("1"), parse("2"), parse("3")) > [](int a, int b, int c) { return a + b + c; });
+        print(std::make_tuple(parse("1"), parse(""), parse("3")) > [](int a, int b, int c) { return a + b + c; });
+
+        std::vector<R> rs { R(Ok, 1), R(Ok, 2), R(Ok, 3) };
+        auto seq = monad_sequence(rs);
+        std::cout << seq.is_ok() << seq.ok().size() << std::endl;
+        rs.push_back(R(Error, "bad"));
+        seq = monad_sequence(rs);
+        std::cout << seq.is_error() << seq.error() << std::endl;
+
+        constexpr auto wrapped = monad<result<int, test_state>>::wrap(5);
+        static_assert(wrapped.is_ok() && wrapped.ok() == 5, "constexpr result monad");
+    }
+
+    // test pipelines without copies
+    if (true) {
+        auto append = [](const char *suffix) {
+            return [suffix](counted c) {
+                c.payload += suffix;
+                return c;
+            };
+        };
+        counted::copies = 0;
+
+        auto m = ((maybe<counted>(counted("m")) > append("a")) > append("b")) >= [](counted c) {
+            return maybe<counted>(std::move(c));
+        };
+
+        std::vector<counted> v;
+        v.emplace_back("v");
+        v.emplace_back("w");
+        auto v2 = (std::move(v) > append("a")) > append("b");
+
+        // promise values are shared by every continuation, so stages read them by reference
+        auto p = (promise<counted>::create(counted("p")) > [](const counted &c) {
+            return counted(c.payload + "a");
+        }) > [](const counted &c) {
+            return counted(c.payload + "b");
+        };
+
+        using R = result<counted, int>;
+        auto r = ((R(Ok, counted("r")) > append("a")) > append("b")) >= [](counted c) {
+            return R(Ok, std::move(c));
+        };
+        auto joined = monad<R>::join(result<R, int>(Ok, R(Ok, counted("j"))));
+
+        std::cout << m.get().payload << ", " << v2[0].payload << v2[1].payload << ", " << p->result().payload
+            << ", " << r.ok().payload << ", " << joined.ok().payload << std::endl;
+        std::cout << "copies = " << counted::copies << std::endl;
+    }
+
+    // test upstream promises are released once resolved
+    if (true) {
+        auto root = promise<int>::create();
+        std::vector<promise_weak_ptr<int>> upstream;
+        promise_ptr<int> p = root;
+        for (int i = 0; i < 100; i++) {
+            p = p > [](int x) { return x + 1; };
+            upstream.push_back(p);
+        }
+        upstream.pop_back();
+        p = p >= [](int x) { return promise<int>::create(x * 2); };
+
+        size_t alive_before = 0, alive_after = 0;
+        for (auto &w : upstream) alive_before += !w.expired();
+        root->resolve(0);
+        for (auto &w : upstream) alive_after += !w.expired();
+        std::cout << p->result() << ", " << alive_before << ", " << alive_after << std::endl;
+    }
+
+    // test generic holder
+    if (true) {
+        auto object = std::make_shared<int>(1);
+        generic_holder<std::shared_ptr<int>> holder;
+        for (int i = 0; i < 5; i++) {
+            holder.hold(object);
+        }
+        generic_holder<std::shared_ptr<int>> moved(std::move(holder));
+        std::cout << moved.size() << ", " << holder.size() << ", " << object.use_count() << std::endl;
+        moved.clear();
+        std::cout << object.use_count() << std::endl;
+
+        // objects whose destruction reaches back into the holder
+        generic_holder<std::shared_ptr<int>> reentrant;
+        int deleted = 0;
+        for (int i = 0; i < 4; i++) {
+            reentrant.hold(std::shared_ptr<int>(new int(i), [&](int *p) {
+                deleted++;
+                if (*p == 0) {
+                    reentrant.hold(object);
+                }
+                reentrant.clear();
+                delete p;
+            }));
+        }
+        reentrant.clear();
+        std::cout << deleted << " " << reentrant.size() << " " << object.use_count() << std::endl;
+
+        // releasing one object keeps the rest in order, inline or spilled
+        generic_holder<std::shared_ptr<int>> some;
+        for (int i = 0; i < 5; i++) {
+            some.hold(std::make_shared<int>(i));
+        }
+        some.release_if([](const std::shared_ptr<int> &p) { return *p == 1; });
+        some.release_if([](const std::shared_ptr<int> &p) { return *p == 3; });
+        some.release_if([](const std::shared_ptr<int> &p) { return *p == 7; });
+        std::string left;
+        while (some.size() > 0) {
+            int first = -1;
+            some.release_if([&](const std::shared_ptr<int> &p) { first = *p; return true; });
+            left += std::to_string(first);
+        }
+        std::cout << left << std::endl;
+    }
+
+    // test a throwing continuation leaves the rest queued
+    if (true) {
+        auto &scheduler = continuation_scheduler::get();
+        scheduler.set_trampoline(true);
+        std::string order;
+        auto throwing = [&](const std::string &name) {
+            try {
+                scheduler.dispatch([&]() {
+                    scheduler.dispatch([&]() { order += name + "1 "; });
+                    scheduler.dispatch([&]() { order += name + "2 "; });
+                    throw 1;
+                });
+            } catch (int) {
+                order += "caught ";
+            }
+        };
+        throwing("a");
+        bool pending = scheduler.has_pending();
+        scheduler.run_pending();
+        throwing("b");
+        scheduler.dispatch([&]() { order += "next "; });
+        std::cout << pending << scheduler.has_pending() << " " << order << std::endl;
+        scheduler.set_trampoline(false);
+    }
+
+    // test trampolined dispatch keeps the stack flat
+    if (true) {
+        auto &scheduler = continuation_scheduler::get();
+        auto stack_depth = [](const char *top) {
+            char marker;
+            return (size_t) (top - &marker);
+        };
+
+        for (bool trampoline : { false, true }) {
+            scheduler.set_trampoline(trampoline);
+            char top;
+            size_t promise_depth = 0, observable_depth = 0;
+
+            auto root = promise<int>::create();
+            promise_ptr<int> p = root;
+            for (int i = 0; i < 1000; i++) {
+                p = p > [](int x) { return x + 1; };
+            }
+            p->then([&](int) { promise_depth = stack_depth(&top); });
+            root->resolve(0);
+
+            auto o = observable<int>::create(0);
+            observable_ptr<int> last = o;
+            for (int i = 0; i < 1000; i++) {
+                last = last > [](int x) { return x + 1; };
+            }
+            auto handle = last->observe([&](int) { observable_depth = stack_depth(&top); });
+            o->push(1);
+
+            std::vector<promise_ptr<int>> ps;
+            for (int i = 0; i < 1000; i++) {
+                ps.push_back(promise<int>::create(i));
+            }
+            auto seq = monad_sequence(ps);
+
+            std::cout << trampoline << ": " << p->result() << ", " << last->get() << ", " << seq->result().size() << ", "
+                << (promise_depth < 16384) << (observable_depth < 16384) << std::endl;
+        }
+        scheduler.set_trampoline(false);
+    }
+
+    // test event loop
+    if (true) {
+        event_loop loop;
+        std::vector<std::string> order;
+
+        auto slow = delay(loop, std::chrono::milliseconds(5), std::string("slow"));
+        auto fast = delay(loop, std::chrono::milliseconds(1), std::string("fast"));
+        auto cascaded = delay(loop, std::chrono::milliseconds(100), std::string("cascaded"));
+        auto never = promise<int>::create();
+        auto timed_out = timeout_or_empty(loop, never, std::chrono::milliseconds(2));
+        never.reset();
+        // cancels its timer once fast resolves, or run() would wait a minute
+        auto in_time = timeout_or_empty(loop, fast, std::chrono::minutes(1));
+
+        for (auto p : {slow, fast, cascaded}) {
+            p->then([&](const std::string &s) { order.push_back(s); });
+        }
+        timed_out->then([&](const maybe<int> &m) { order.push_back(m.has_data() ? "value" : "timeout"); });
+        std::string in_time_out;
+        in_time->then([&](const maybe<std::string> &m) { in_time_out = m.has_data() ? m.get() : "timeout"; });
+
+        auto later = promise<int>::create();
+        int later_value = 0; // whether it runs before the first timer depends on timing
+        later->then([&](int x) { later_value = x; });
+        loop.resolve_later(later, 7);
+
+        auto o = observable<int>::create(0);
+        int pushes = 0;
+        auto handle = o->observe([&](int) { pushes++; });
+        loop.push_later(o, 1);
+        loop.push_later(o, 2);
+        loop.push_later(o, 3);
+
+        auto cancelled = loop.add_timer(std::chrono::milliseconds(3), [&]() { order.push_back("cancelled"); });
+        loop.cancel_timer(cancelled);
+
+        loop.run();
+        for (auto &s : order) {
+            std::cout << s << " ";
+        }
+        std::cout << "| " << pushes << " " << o->get() << " " << loop.lag().samples << " " << in_time_out << " " << later_value << std::endl;
+    }
+
+    // test file io
+    if (true) {
+        for (bool use_io_uring : {true, false}) {
+            event_loop loop;
+            file_io io(loop, 16, 4, use_io_uring);
+            char path[] = "/tmp/monad_file_io_XXXXXX";
+            int fd = mkstemp(path);
+            unlink(path);
+
+            std::string out, bad_out;
+            auto written = io.write(fd, 0, std::string("hello, file io"));
+            auto read_back = written >= [&](size_t n) {
+                out += "wrote " + std::to_string(n) + ", ";
+                return io.read(fd, 7, 16);
+            };
+            read_back->then([&](const file_io::read_result &r) {
+                out += "read '" + r.ok().str() + "' " + std::to_string(r.ok().registered_index() >= 0) + ", ";
+            });
+            auto bad = io.read(-1, 0, 4);
+            bad->then([&](const file_io::read_result &r) {
+                bad_out = r.is_ok() ? "ok" : "error " + std::to_string(r.error().code == EBADF);
+            });
+
+            loop.run();
+            close(fd);
+            std::cout << out << bad_out << " " << io.pending() << std::endl;
+        }
+    }
+
+    // test mmap stream
+    if (true) {
+        char path[] = "/tmp/monad_mmap_stream_XXXXXX";
+        int fd = mkstemp(path);
+        std::string content;
+        for (int i = 0; i < 10; i++) {
+            content += "line " + std::to_string(i) + "\n";
+        }
+        content += "tail";
+        ssize_t unused = write(fd, content.data(), content.size());
+        (void) unused;
+        close(fd);
+
+        auto file = mapped_file::open(path);
+        unlink(path);
+
+        mmap_stream_options options;
+        options.chunk_size = 16;
+        mmap_stream chunks(file.ok(), options);
+        std::string joined;
+        size_t pushes = 0;
+        bool in_mapping = true;
+        auto handle = chunks.get_observable()->observe([&](const mapped_span &span) {
+            joined += span.str();
+            pushes++;
+            in_mapping = in_mapping && span.data() >= file.ok()->data() && span.end() <= file.ok()->data() + file.ok()->size();
+        });
+        event_loop loop;
+        chunks.run(loop);
+        loop.run();
+
+        options.push = mmap_stream_options::mode::records;
+        mmap_stream records(file.ok(), options);
+        auto lengths = records.get_observable() > [](const mapped_span &span) { return span.size(); };
+        size_t total = 0, count = 0;
+        auto handle2 = lengths->observe([&](size_t n) { total += n; count++; });
+        while (records.next()) {}
+
+        // chunks shorter than a record still push whole records
+        options.chunk_size = 4;
+        mmap_stream small(file.ok(), options);
+        std::string small_records;
+        auto handle3 = small.get_observable()->observe([&](const mapped_span &span) { small_records += span.str() + ","; });
+        while (small.next()) {}
+
+        std::cout << (joined == content) << in_mapping << " " << pushes << " " << count << " " << total
+            << " " << mapped_file::open("/nonexistent").is_error() << " " << small_records << std::endl;
+    }
+
+    // test timeout, deadline and retry
+    if (true) {
+        using R = result<int, std::string>;
+        using namespace std::chrono;
+        virtual_clock clock;
+        auto print = [](const R &r) { return r.is_ok() ? "ok " + std::to_string(r.ok()) : "error " + r.error(); };
+
+        auto stuck = promise<R>::create();
+        promise_weak_ptr<R> weak_stuck(stuck);
+        auto timed = timeout(clock, stuck, milliseconds(100), std::string("timeout"));
+        stuck.reset();
+        clock.advance(milliseconds(99));
+        std::cout << timed->is_finished() << weak_stuck.expired() << " ";
+        clock.advance(milliseconds(1));
+        std::cout << print(timed->result()) << " " << weak_stuck.expired() << ", ";
+
+        auto fast = promise<R>::create();
+        auto in_time = timeout(clock, fast, milliseconds(100), std::string("timeout"));
+        fast->resolve(R(Ok, 5));
+        std::cout << print(in_time->result()) << " " << clock.pending() << ", ";
+
+        std::string attempts;
+        std::vector<promise_weak_ptr<R>> tried;
+        size_t alive = 0; // earlier attempts still held when the next one starts
+        retry_policy<std::string> policy("timeout");
+        policy.max_attempts = 5;
+        auto flaky = retry(clock, policy, [&](const monad_deadline &) {
+            attempts += std::to_string(clock.now()) + " ";
+            for (auto &w : tried) alive += !w.expired();
+            auto p = promise<R>::create();
+            tried.push_back(p);
+            if (attempts.size() < 12) {
+                p->resolve(R(Error, std::string("flaky")));
+            } else {
+                p->resolve(R(Ok, 42));
+            }
+            return p;
+        });
+        clock.advance(milliseconds(1000));
+        std::cout << print(flaky->result()) << " after " << attempts << alive << " | ";
+
+        policy.attempt_timeout = milliseconds(50);
+        policy.deadline = monad_deadline::after(clock, milliseconds(120));
+        std::string budgets;
+        auto hung = retry(clock, policy, [&](const monad_deadline &d) {
+            budgets += std::to_string(d.remaining(clock).count()) + " ";
+            return promise<R>::create();
+        });
+        clock.advance(milliseconds(1000));
+        std::cout << print(hung->result()) << " budgets " << budgets << clock.pending() << std::endl;
+    }
+
+    // test concurrent promise apply
+    if (true) {
+        auto a = promise<int>::create();
+        auto b = promise<std::string>::create();
+        auto sum = std::make_tuple(a, b, promise<int>::create(3)) > [](int a, const std::string &b, int c) {
+            return b + std::to_string(a + c);
+        };
+        b->resolve("b");
+        std::cout << sum->is_finished() << " ";
+        a->resolve(1);
+        std::cout << sum->result() << ", ";
+
+        using R = result<int, std::string>;
+        auto fails = promise<R>::create();
+        auto slow = promise<R>::create();
+        promise_weak_ptr<R> weak_slow(slow);
+        auto applied = std::make_tuple(promise<R>::create(R(Ok, 1)), slow, fails) > [](int a, int b, int c) { return a + b + c; };
+        slow.reset();
+        fails->resolve(R(Error, std::string("fails")));
+        std::cout << applied->result().error() << " " << weak_slow.expired() << ", ";
+
+        auto x = promise<R>::create();
+        auto y = promise<R>::create();
+        auto both = std::make_tuple(x, y) > [](int x, int y) { return x * y; };
+        y->resolve(R(Ok, 6));
+        x->resolve(R(Ok, 7));
+        std::cout << both->result().ok() << std::endl;
+    }
+
+    // test continuation priority
+    if (true) {
+        using clock = std::chrono::steady_clock;
+        const continuation_tag interactive(continuation_priority::interactive);
+        const continuation_tag background(continuation_priority::background);
+        std::string order;
+
+        auto p = promise<int>::create();
+        p->then([&](int) { order += "n"; });
+        p->then([&](int) { order += "b"; }, background);
+        p->then([&](int) { order += "i"; }, interactive);
+        p->then([&](int) { order += "l"; }, continuation_tag(continuation_priority::normal, clock::now() + std::chrono::seconds(2)));
+        p->then([&](int) { order += "e"; }, continuation_tag(continuation_priority::normal, clock::now() + std::chrono::seconds(1)));
+        p->resolve(0);
+        order += " ";
+
+        auto o = observable<int>::create(0);
+        auto h1 = o->observe([&](int) { order += "n"; });
+        auto h2 = o->observe([&](int) { order += "i"; }, interactive);
+        auto h3 = o->observe([&](int) { order += "b"; }, background);
+        o->push(1);
+        order += " ";
+
+        // stages built in a scope inherit its tag, across a trampolined batch
+        auto &scheduler = continuation_scheduler::get();
+        scheduler.set_trampoline(true);
+        auto bulk = promise<int>::create();
+        auto urgent = promise<int>::create();
+        auto bulk_done = bulk > [&](int) { order += "b"; return 0; };
+        promise_ptr<int> urgent_done;
+        {
+            continuation_tag_scope scope(interactive);
+            urgent_done = urgent > [&](int) {
+                order += continuation_scheduler::get().current().priority == continuation_priority::interactive ? "I" : "?";
+                return 0;
+            };
+        }
+        bulk_done->then([&](int) { order += "B"; });
+        scheduler.dispatch([&]() {
+            bulk->resolve(1);
+            urgent->resolve(1);
+        });
+        scheduler.set_trampoline(false);
+
+        std::cout << order << " " << (scheduler.current().priority == continuation_priority::normal) << std::endl;
+    }
+
+    // test batch resolve
+    if (true) {
+        std::string order;
+        auto chain = [&](const std::string &name) {
+            auto root = promise<int>::create();
+            auto last = root > [&, name](int x) { order += name + "1 "; return x + 1; }
+                > [&, name](int x) { order += name + "2 "; return x + 1; };
+            last->then([&, name](int x) { order += name + std::to_string(x) + " "; });
+            return std::make_pair(root, last);
+        };
+
+        auto a = chain("a");
+        auto b = chain("b");
+        a.first->resolve(0);
+        b.first->resolve(10);
+        order += "| ";
+
+        auto c = chain("c");
+        auto d = chain("d");
+        auto s = promise<std::string>::create();
+        s->then([&](const std::string &v) { order += v + " "; });
+        promise_batch batch;
+        batch.add(c.first, 0);
+        batch.add(d.first, 10);
+        batch.add(s, "s");
+        auto early = promise<int>::create();
+        batch.add(early, 5);
+        early->then([&](int x) { order += "early" + std::to_string(x) + " "; });
+        std::cout << c.first->is_finished() << (c.first->result() == 0) << order.size() << " ";
+        continuation_scheduler::get().set_trampoline(true);
+        batch.resolve();
+        continuation_scheduler::get().set_trampoline(false);
+        {
+            // resolved when the batch goes away
+            promise_batch dropped;
+            auto late = promise<int>::create();
+            late->then([&](int x) { order += "late" + std::to_string(x) + " "; });
+            dropped.add(late, 7);
+        }
+        order += "| ";
+
+        auto e = chain("e");
+        auto f = chain("f");
+        resolve_all<int>({{e.first, 0}, {f.first, 10}});
+        std::cout << order << continuation_scheduler::get().is_trampoline() << std::endl;
+    }
+
+    // test channel
+    if (true) {
+        auto spsc = channel<int>::create(64);
+        std::thread producer([spsc]() {
+            for (int i = 1; i <= 10000; i++) {
+                spsc->send(i);
+            }
+            spsc->close();
+        });
+        long long sum = 0;
+        while (!spsc->is_finished()) {
+            spsc->receive_all([&](int x) { sum += x; });
+        }
+        producer.join();
+
+        auto mpsc = channel<int, channel_producers::multiple>::create(16);
+        std::vector<std::thread> producers;
+        for (int t = 0; t < 4; t++) {
+            producers.emplace_back([mpsc]() {
+                for (int i = 0; i < 1000; i++) {
+                    mpsc->send(1);
+                }
+            });
+        }
+        int count = 0;
+        while (count < 4000) {
+            count += int(mpsc->receive_all([](int) {}));
+        }
+        for (auto &t : producers) {
+            t.join();
+        }
+
+        auto small = channel<std::string>::create(2);
+        std::string kept = "kept";
+        bool third = (small->try_send(std::string("a")), small->try_send(std::string("b")), small->try_send(std::move(kept)));
+        std::cout << sum << " " << count << " " << third << kept << " ";
+
+        // fmap and bind, filled as the consumer receives
+        auto source = channel<int>::create(4);
+        auto derived = (source > [](int x) { return x * 10; }) >= [](int x) {
+            auto ch = channel<int>::create(2);
+            ch->try_send(x);
+            ch->try_send(x + 1);
+            ch->close();
+            return ch;
+        };
+        for (int i = 1; i <= 3; i++) {
+            source->try_send(i);
+        }
+        source->close();
+        while (!derived->is_finished()) {
+            derived->receive_all([](int x) { std::cout << x << ","; });
+        }
+
+        // from a producer thread into an observable on the loop
+        event_loop loop;
+        auto feed = channel<int, channel_producers::multiple>::create(8);
+        auto o = to_observable(loop, feed, 0);
+        int pushes = 0;
+        auto handle = o->observe([&](int) { pushes++; });
+        std::thread feeder([feed]() {
+            for (int i = 1; i <= 100; i++) {
+                feed->send(i);
+            }
+            feed->close();
+        });
+        loop.run();
+        feeder.join();
+
+        // derived channels wake the loop when their source is sent to
+        auto fed = channel<int>::create(8);
+        auto mapped = to_observable(loop, (fed > [](int x) { return x * 2; }) >= [](int x) {
+            auto ch = channel<int>::create(1);
+            ch->try_send(x);
+            ch->close();
+            return ch;
+        }, 0);
+        int mapped_pushes = 0;
+        auto mapped_handle = mapped->observe([&](int) { mapped_pushes++; });
+        std::thread mapper([fed]() {
+            for (int i = 1; i <= 100; i++) {
+                fed->send(i);
+            }
+            fed->close();
+        });
+        loop.run();
+        mapper.join();
+
+        // one source feeding two derived channels wakes both consumers
+        auto shared = channel<int>::create(8);
+        int shared_count = 0;
+        auto left = to_observable(loop, shared > [](int x) { return x; }, 0);
+        auto right = to_observable(loop, shared > [](int x) { return -x; }, 0);
+        auto left_handle = left->observe([&](int) { shared_count++; });
+        auto right_handle = right->observe([&](int) { shared_count++; });
+        std::thread sharer([shared]() {
+            for (int i = 1; i <= 100; i++) {
+                shared->send(i);
+            }
+            shared->close();
+        });
+        loop.run();
+        sharer.join();
+        auto closed_source = channel<int>::create(1);
+        closed_source->close();
+        auto closed_derived = closed_source > [](int x) { return x; };
+
+        auto p = promise<std::string>::create();
+        auto from_p = from_promise(p);
+        p->resolve("resolved");
+        auto first = next_value(loop, from_p);
+        loop.run();
+        std::cout << " " << pushes << " " << o->get() << " " << first->result() << " " << mapped_pushes << " " << mapped->get()
+            << " " << closed_derived->is_finished() << " " << shared_count << std::endl;
+    }
+
+    // test stream
+    if (true) {
+        std::vector<int> numbers;
+        for (int i = 1; i <= 10; i++) {
+            numbers.push_back(i);
+        }
+        auto doubled = stream<int>::from_vector(numbers, 4) > [](int x) { return x * 2; };
+        auto big = stream_filter(doubled, [](int x) { return x > 10; });
+        auto pairs = big >= [](int x) {
+            return stream<std::string>::from_vector({ std::to_string(x), "." });
+        };
+        stream_collect(pairs)->then([](const std::vector<std::string> &items) {
+            for (auto &item : items) {
+                std::cout << item;
+            }
+        });
+
+        size_t chunks = 0;
+        stream_for_each_chunk(stream<int>::from_vector(numbers), [&](const std::vector<int> &) { chunks++; }, 3)->then([&](size_t count) {
+            std::cout << " " << count << " in " << chunks;
+        });
+
+        std::vector<stream_ptr<int>> streams = { stream<int>::from_vector({ 1, 2, 3 }, 2), stream<int>::from_vector({ 4, 5 }) };
+        stream_collect(monad_sequence(streams))->then([](const std::vector<std::vector<int>> &seqs) {
+            std::cout << " |";
+            for (auto &seq : seqs) {
+                std::cout << " " << seq[0] << seq[1];
+            }
+        });
+
+        // inner streams fill a pull together, and empty ones do not grow the stack
+        size_t filled = 0;
+        auto singles = stream<int>::from_vector(numbers) >= [](int x) { return stream<int>::from_vector({ x }); };
+        stream_for_each_chunk(singles, [&](const std::vector<int> &) { filled++; }, 4);
+        std::vector<int> many(100000, 1);
+        many[500] = 2;
+        auto sparse = stream<int>::from_vector(many) >= [](int x) {
+            return stream<int>::from_vector(x == 2 ? std::vector<int>{ x } : std::vector<int>());
+        };
+        stream_collect(sparse)->then([&](const std::vector<int> &items) {
+            std::cout << " | " << filled << " " << items.size();
+        });
+
+        // chunks arriving later
+        std::vector<promise_ptr<stream_chunk<int>>> pending;
+        auto later = stream<int>::create([&pending](size_t) {
+            auto p = promise<stream_chunk<int>>::create();
+            pending.push_back(p);
+            return p;
+        });
+        auto sum = stream_collect(later > [](int x) { return x + 1; });
+        stream_chunk<int> first;
+        first.items = { 1, 2, 3 };
+        pending[0]->resolve(std::move(first));
+        stream_chunk<int> last;
+        last.items = { 4 };
+        last.last = true;
+        pending[1]->resolve(std::move(last));
+        std::cout << " | " << pending.size() << " " << sum->result().size() << " " << sum->result()[3] << std::endl;
+    }
+
+    // test observable modify
+    if (true) {
+        auto o = observable<std::vector<int>>::create({ 1, 2, 3, 4 });
+        int calls = 0;
+        auto squares = fmap_elements(o, [&](int x) { calls++; return x * x; });
+        auto sum = squares > [](const std::vector<int> &v) {
+            int s = 0;
+            for (int x : v) {
+                s += x;
+            }
+            return s;
+        };
+        size_t whole = 0;
+        auto handle = o->observe([&](const std::vector<int> &v) { whole = v.size(); });
+        o->modify([](std::vector<int> &v) {
+            v[2] = 10;
+            return vector_delta { { 2 } };
+        });
+        std::cout << calls << " " << whole << " " << squares->get()[2] << " " << sum->get();
+        o->modify([](std::vector<int> &v) { v.push_back(5); });
+        std::cout << ", " << calls << " " << sum->get();
+        // a delta that resizes falls back to mapping every element
+        o->modify([](std::vector<int> &v) {
+            v.push_back(6);
+            return vector_delta { { 5 } };
+        });
+        std::cout << " " << squares->get().size() << " " << sum->get();
+
+        auto m = observable<std::map<std::string, int>>::create({ { "a", 1 }, { "b", 2 } });
+        auto labels = fmap_values(m, [](int x) { return std::to_string(x * 10); });
+        m->modify([](std::map<std::string, int> &v) {
+            v["c"] = 3;
+            v.erase("a");
+            return map_delta<std::string> { { "c" }, { "a" } };
+        });
+        std::cout << ",";
+        for (auto &it : labels->get()) {
+            std::cout << " " << it.first << "=" << it.second;
+        }
+        std::cout << std::endl;
+    }
+
+    // test observable collection
+    if (true) {
+        auto people = observable_collection<int, std::pair<std::string, int>>::create();
+        people->set(1, { "ann", 31 });
+        people->set(2, { "bob", 17 });
+        people->set(3, { "cid", 45 });
+        int mapped = 0;
+        auto adults = collection_filter(people, [](const std::pair<std::string, int> &p) { return p.second >= 18; });
+        auto names = collection_fmap(adults, [&](const std::pair<std::string, int> &p) { mapped++; return p.first; });
+        auto by_age = collection_sort(adults, [](const std::pair<std::string, int> &a, const std::pair<std::string, int> &b) { return a.second < b.second; });
+        std::string events;
+        auto handle = by_age->observe([&](const collection_change<int, std::pair<std::string, int>> &c) {
+            events += c.op == collection_change<int, std::pair<std::string, int>>::kind::erase ? "-" : "+";
+            events += std::to_string(c.key) + (c.next ? "<" + std::to_string(*c.next) : "") + " ";
+        });
+        people->set(2, { "bob", 18 });
+        people->set(4, { "dee", 20 });
+        people->set(1, { "ann", 50 });
+        people->erase(3);
+        people->set(4, { "dee", 12 });
+        std::cout << mapped << " " << names->size() << " " << *names->find(2) << " | " << events << "|";
+        by_age->for_each([](int, const std::pair<std::string, int> &p) { std::cout << " " << p.first; });
+        std::cout << std::endl;
+    }
+
+    // test memoize
+    if (true) {
+        int computed = 0;
+        auto label = memoize<int>([&](int x) { computed++; return std::string(size_t(x), '*'); }, 2);
+        auto state = observable<int>::create(1);
+        auto labels = state > label;
+        for (int x : { 2, 1, 2, 3, 1, 1 }) {
+            state->push(x);
+        }
+        auto p = promise<int>::create();
+        auto q = promise<int>::create();
+        auto from_p = p > label;
+        auto from_q = q > label;
+        p->resolve(1);
+        q->resolve(1);
+        std::cout << labels->get() << " " << from_q->result() << " " << computed << " "
+            << label.stats().hits << " " << label.stats().misses << " " << label.stats().evictions << std::endl;
+    }
+
+    // test observable graph
+    if (true) {
+        observable_graph<double> sheet;
+        int computed = 0;
+        auto sum = sheet.add_formula([&](const double *in, size_t count) {
+            computed++;
+            double s = 0;
+            for (size_t i = 0; i < count; i++) {
+                s += in[i];
+            }
+            return s;
+        });
+        auto a = sheet.add(1);
+        auto b = sheet.add(2);
+        auto c = sheet.add(sum, { a, b });
+        auto d = sheet.fmap(c, [&](double x) { computed++; return x * 2; });
+        auto e = sheet.add(sum, { c, d });
+        std::vector<double> seen;
+        sheet.observe(e, [&](double x) { seen.push_back(x); });
+        computed = 0;
+        sheet.push(a, 10);
+        sheet.push(b, 0);
+        std::cout << sheet.get(e) << " " << computed << " " << seen.size() << " " << seen[0] << " "
+            << (sheet.memory_bytes() >= sheet.size() * observable_graph<double>::node_bytes) << std::endl;
+    }
+
+    // test snapshot
+    if (true) {
+        int computed = 0;
+        auto build = [&](observable_snapshot &snapshot) {
+            auto scores = observable<std::map<std::string, int>>::create();
+            auto total = scores > [&](const std::map<std::string, int> &m) {
+                computed++;
+                int sum = 0;
+                for (auto &it : m) {
+                    sum += it.second;
+                }
+                return std::to_string(sum);
+            };
+            snapshot.add("scores", scores);
+            snapshot.add("total", total);
+            return std::make_pair(scores, total);
+        };
+
+        observable_snapshot before;
+        auto graph = build(before);
+        graph.first->push({ { "a", 3 }, { "b", 4 } });
+        char path[] = "/tmp/monad_snapshot_XXXXXX";
+        close(mkstemp(path));
+        auto saved = before.save_file(path);
+
+        observable_snapshot after;
+        auto restarted = build(after);
+        int notified = 0;
+        auto handle = restarted.second->observe([&](const std::string &) { notified++; });
+        computed = 0;
+        auto restored = after.restore_file(path);
+        unlink(path);
+        std::cout << saved.is_ok() << " " << restored.ok() << " " << restarted.second->get() << " " << restarted.first->get().at("b") << " "
+            << computed << notified;
+
+        observable_snapshot mismatch;
+        mismatch.add("total", observable<int>::create(0));
+        auto blob = before.save();
+        auto wrong = mismatch.restore(blob.data(), blob.size());
+        auto torn = after.restore(blob.data(), blob.size() - 1);
+        std::cout << " " << wrong.error().message() << ", " << torn.error().message();
+
+        observable_snapshot flags;
+        auto bits = observable<std::vector<bool>>::create(std::vector<bool> { true, false, true });
+        flags.add("bits", bits);
+        auto bits_blob = flags.save();
+        bits->push({});
+        flags.restore(bits_blob.data(), bits_blob.size());
+        std::cout << ", " << bits->get().size() << bits->get()[0] << bits->get()[1] << bits->get()[2]
+            << ", " << after.restore_file("/nonexistent").error().message() << std::endl;
+    }
+
     // test monad apply
     if (true) {
         promise_ptr<int> p1 = monad<promise_ptr<int>>::wrap(20);
@@ -223,6 +1145,23 @@ int main()
         std::cout << std::endl;
     }
 
+    // test vector fmap
+    if (true) {
+        std::vector<float> vf {1.5f, 2.5f, 3.5f};
+        auto result = vf > [](float x) { return x * 2.0f + 1.0f; };
+        for (auto &r : result) {
+            std::cout << r << ", ";
+        }
+        std::cout << std::endl;
+
+        std::vector<int> vi {1, 2, 3};
+        auto strs = vi > [](int x) { return std::to_string(x * 10); };
+        for (auto &r : strs) {
+            std::cout << r << ", ";
+        }
+        std::cout << std::endl;
+    }
+
     // test sequence promise
     if (true) {
         promise_ptr<int> p_11 = monad<promise_ptr<int>>::wrap(11);
@@ -0,0 +1,44 @@
+// instrumentation is a separate build, test.cpp covers the default one
+#define MONAD_INSTRUMENTATION
+#define mr_assert(x)
+#define DISALLOW_COPY_AND_ASSIGN(c_class)                    \
+    c_class(const c_class &source) = delete;                                         \
+    c_class &operator=(const c_class &source) = delete;
+
+#include <stdio.h>
+#include <iostream>
+#include <sstream>
+
+#include "promise.h"
+#include "observable.h"
+
+int main()
+{
+    // test instrumentation
+    if (true) {
+        auto &instrumentation = monad_instrumentation::get();
+        instrumentation.reset_stats();
+        auto &stats = instrumentation.stats();
+        size_t live_before = stats.live_nodes["promise<int>"];
+
+        auto root = promise<int>::create();
+        auto p = ((root > [](int x) { return x + 1; }) > [](int x) { return x * 2; }) > [](int x) { return x - 1; };
+        std::cout << stats.live_nodes["promise<int>"] - live_before << ", " << stats.max_chain_depth << std::endl;
+        root->resolve(1);
+        std::cout << p->result() << ", " << stats.callbacks_fired << ", " << stats.resolve_latency.count() << std::endl;
+
+        auto o = observable<int>::create(1);
+        auto o2 = o > [](int x) { return x + 1; };
+        o->push(2);
+        std::cout << o2->get() << ", " << stats.push_latency.count() << std::endl;
+
+        std::ostringstream dot, json;
+        instrumentation.dump_dot(dot);
+        instrumentation.dump_json(json);
+        std::cout << (dot.str().find("promise<int>") != std::string::npos)
+            << (json.str().find("observable<int>") != std::string::npos) << std::endl;
+        p.reset();
+        std::cout << stats.live_nodes["promise<int>"] - live_before << std::endl;
+    }
+    return 0;
+}